@@ -4,6 +4,8 @@
  *  SPDX-License-Identifier: GPL-2.0+
  */
 
+#define _DEFAULT_SOURCE	/* for tm_gmtoff */
+
 #include "cvs.h"
 #include "hash.h"
 
@@ -11,6 +13,147 @@
 
 static cvs_author	*author_buckets[AUTHOR_HASH];
 
+/*
+ * Each timezone named in the map is turned into a table of the instants
+ * its offset from UTC changes, found by probing localtime_r(3) once at
+ * load time, so that export need not switch TZ and call tzset(3) for
+ * every commit.  The table covers 1970 to 2038, probed a day apart;
+ * no zone in the tz database changes its offset twice in less than a
+ * week in that span.  Dates outside it take the slow road.
+ */
+#define ZONE_FIRST	((time_t)0)
+#define ZONE_LAST	((time_t)INT32_MAX)
+#define ZONE_PROBE	(24 * 60 * 60)
+
+typedef struct _cvs_zone {
+    struct _cvs_zone	*next;
+    const char		*name;
+    time_t		*at;		/* ascending, the first is ZONE_FIRST */
+    long		*offset;	/* seconds east of UTC from at[i] */
+    size_t		count, max;
+} cvs_zone;
+
+static cvs_zone		*zones;
+
+static long
+gmtoff(const time_t when)
+{
+    struct tm tm;
+
+    if (localtime_r(&when, &tm) == NULL)
+	return 0;
+    return tm.tm_gmtoff;
+}
+
+static void
+zone_add(cvs_zone *z, const time_t at, const long offset)
+{
+    if (z->count >= z->max) {
+	z->max = z->max ? z->max * 2 : 64;
+	z->at = xrealloc(z->at, z->max * sizeof(time_t), "timezone table");
+	z->offset = xrealloc(z->offset, z->max * sizeof(long),
+			     "timezone table");
+    }
+    z->at[z->count] = at;
+    z->offset[z->count] = offset;
+    z->count++;
+}
+
+static void
+set_tz(const char *tz)
+{
+    if (tz != NULL)
+	setenv("TZ", tz, 1);
+    else
+	unsetenv("TZ");
+    tzset();
+}
+
+static const cvs_zone *
+zone_load(const char *name)
+/* the transition table of the timezone NAME, an atom */
+{
+    char tzbuf[BUFSIZ], *oldtz = getenv("TZ");
+    cvs_zone *z;
+    time_t t, next, lo, hi;
+    long offset;
+
+    for (z = zones; z; z = z->next)
+	if (z->name == name)
+	    return z;
+    z = xcalloc(1, sizeof(cvs_zone), "timezone table");
+    z->name = name;
+    z->next = zones;
+    zones = z;
+
+    /* make a copy in case original is clobbered */
+    if (oldtz != NULL) {
+	strncpy(tzbuf, oldtz, sizeof(tzbuf) - 1);
+	tzbuf[sizeof(tzbuf) - 1] = '\0';
+    }
+    set_tz(name);
+    offset = gmtoff(ZONE_FIRST);
+    zone_add(z, ZONE_FIRST, offset);
+    for (t = ZONE_FIRST; t < ZONE_LAST; t = next) {
+	/* t + ZONE_PROBE alone could overflow a 32-bit time_t */
+	next = ZONE_LAST - t > ZONE_PROBE ? t + ZONE_PROBE : ZONE_LAST;
+	if (gmtoff(next) == offset)
+	    continue;
+	/* narrow down to the first second of the new offset */
+	for (lo = t, hi = next; hi - lo > 1; ) {
+	    time_t mid = lo + (hi - lo) / 2;
+	    if (gmtoff(mid) == offset)
+		lo = mid;
+	    else
+		hi = mid;
+	}
+	offset = gmtoff(hi);
+	zone_add(z, hi, offset);
+	next = hi;
+    }
+    set_tz(oldtz != NULL ? tzbuf : NULL);
+    return z;
+}
+
+static long
+slow_offset(const char *tz, const time_t when)
+{
+    char tzbuf[BUFSIZ], *oldtz = getenv("TZ");
+    long offset;
+
+    if (oldtz != NULL) {
+	strncpy(tzbuf, oldtz, sizeof(tzbuf) - 1);
+	tzbuf[sizeof(tzbuf) - 1] = '\0';
+    }
+    set_tz(tz);
+    offset = gmtoff(when);
+    set_tz(oldtz != NULL ? tzbuf : NULL);
+    return offset;
+}
+
+long
+utc_offset(const cvs_author *author, const time_t when)
+/* seconds east of UTC in the author's timezone at WHEN */
+{
+    const cvs_zone *z;
+    size_t lo, hi;
+
+    if (author == NULL || author->timezone == NULL)
+	return 0;
+    z = author->zone;
+    if (when < ZONE_FIRST || when >= ZONE_LAST)
+	return slow_offset(z->name, when);
+    /* the last transition at or before WHEN */
+    for (lo = 0, hi = z->count; hi - lo > 1; ) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (z->at[mid] <= when)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return z->offset[lo];
+}
+
 static unsigned
 author_hash(const char *name)
 {
@@ -47,6 +190,13 @@ free_author_map(void)
 	    free(a);
 	}
     }
+    while (zones != NULL) {
+	cvs_zone *z = zones;
+	zones = z->next;
+	free(z->at);
+	free(z->offset);
+	free(z);
+    }
 }
 
 bool
@@ -128,6 +278,7 @@ load_author_map(const char *filename)
 		    break;
 	    }
 	    a->timezone = atom(angle);
+	    a->zone = zone_load(a->timezone);
 	}
 	bucket = &author_buckets[author_hash(name)];
 	a->next = *bucket;
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <limits.h>
@@ -31,6 +32,7 @@
 #define CVS_MAX_BRANCHWIDTH	10
 #define CVS_MAX_DEPTH		(2*CVS_MAX_BRANCHWIDTH + 2)
 #define CVS_MAX_REV_LEN		(CVS_MAX_DEPTH * (CVS_MAX_DIGITS + 1))
+#define RCS_DATE_LEN		20	/* "YYYY/MM/DD HH:MM:SS" plus NUL */
 
 
 /*
@@ -59,6 +61,7 @@ typedef struct node {
     struct node *sib;
     const cvs_number *number;
     flag starts;
+    flag needed;	/* on the path to a wanted revision */
 } node_t;
 
 #define NODE_HASH_SIZE	97
@@ -122,9 +125,19 @@ struct out_buffer_type {
 struct in_buffer_type {
     unsigned char *buffer;
     unsigned char *ptr;
+    unsigned char *limit;	/* bulk scans may look this far ahead */
     int read_count;
 };
 
+/*
+ * Where each line of a snapshot came from.  Two snapshots of a master
+ * share a line when it has the same source and the same bytes.
+ */
+typedef struct _line_origin {
+    const unsigned char *source;	/* the line in the master text */
+    size_t length;			/* its length in the snapshot */
+} line_origin_t;
+
 #ifdef LINESTATS
 typedef struct _edit_line {
     unsigned char *ptr;
@@ -150,11 +163,27 @@ typedef struct _editbuffer {
     char *Gabspath;
     cvs_version *Gversion;
     char Gversion_number[CVS_MAX_REV_LEN];
+    /* keyword date of Gdate_version, formatted once per revision */
+    const cvs_version *Gdate_version;
+    char Gdate_string[RCS_DATE_LEN];
     struct out_buffer_type *Goutbuf;
     struct in_buffer_type in_buffer_store;
+    /* edits of skipped revisions not yet applied to the current frame */
+    struct composition *Gcompose;
+    /* line arrays of parent frames pushed out to honor a memory budget */
+    size_t Gbudget;
+    FILE *Gspill;
+    off_t Gspillend;
+    /* origins of the lines of the snapshot, when Gorigins is set */
+    bool Gorigins;
+    line_origin_t *Gorigin;
+    size_t Gorigincount, Goriginmax;
 #ifdef LINESTATS
     int line_len; /* temporary used for insertline */
     int has_stringdelim;
+    /* spans of master text making up an unexpanded snapshot */
+    struct iovec *Gspan;
+    int Gspancount, Gspanmax;
 #endif
     enum expand_mode Gexpand;
     /*
@@ -175,6 +204,17 @@ typedef struct _editbuffer {
 	unsigned char **line;
 #endif
 	size_t gap, gapsize, linemax;
+	/*
+	 * Under -kb a revision that is one unbroken run of master text
+	 * (the head, or the body of a whole-file replacement delta) is
+	 * held as that span and only split into lines on demand.
+	 */
+	flag whole, whole_delim;
+	unsigned char *whole_text;
+	size_t whole_len, whole_lines;	/* SIZE_MAX until counted */
+	/* set while the line array lives in Gspill at spill_offset */
+	flag spilled;
+	off_t spill_offset;
     } stack[CVS_MAX_DEPTH/2], *current;
 #ifdef USE_MMAP
     /* A recently used list of mmapped files */
@@ -308,6 +348,7 @@ typedef struct _cvs_commit {
     unsigned		dead:1;
     /* CVS-only members begin here */
     bool                emitted:1;
+    bool                wanted:1;	/* snapshot needed by incremental dump */
     hash_t              hash;
     /* Shortcut to master->dir, more space but less dereferences
      * in the hottest inner loop in revdir
@@ -345,6 +386,7 @@ typedef struct _rev_ref {
     unsigned		degree:7;	/* # of digits in original CVS version */
     flag		shown:1;	/* only used in graph emission */
     flag		tail:1;
+    flag		realized:1;	/* only used in incremental export */
 } rev_ref;
 
 /* Type punning, previously cvs_master and git_repo were rev_lists underneath
@@ -393,6 +435,7 @@ typedef struct _cvs_author {
     const char		*full;
     const char		*email;
     const char		*timezone;
+    const struct _cvs_zone *zone;	/* transitions of timezone */
 } cvs_author;
 
 /*
@@ -444,9 +487,14 @@ cvs_author *fullname(const char *);
 
 bool load_author_map(const char *);
 
+long utc_offset(const cvs_author *, const time_t);
+
 char *
 cvstime2rfc3339(const cvstime_t date);
 
+void
+cvstime2rcsdate(const cvstime_t date, char *buf);
+
 cvs_number
 lex_number(const char *);
 
@@ -519,6 +567,15 @@ typedef struct _export_options {
     enum {adaptive, fast, canonical} reportmode;
     bool authorlist;
     bool progress;
+    size_t membudget;		/* per-generator line storage, 0 = unbounded */
+    char *packdir;		/* write a pack into this repository */
+    bool packdeltas;		/* store blobs as deltas in the pack */
+    bool compress_spool;	/* compress blobs spooled in canonical mode */
+    size_t blobcache;		/* canonical blobs held in memory, 0 = spool */
+    char *checkpoint;		/* file recording how far the stream got */
+    bool resume;		/* skip what the checkpoint says is shipped */
+    char *import_marks;		/* marks of what the importer already has */
+    char *export_marks;		/* where to record the marks of this run */
 } export_options_t;
 
 typedef struct _export_stats {
@@ -639,18 +696,37 @@ path_deep_compare(const void *a, const void *b);
 
 #define time_compare(a,b) ((long)(a) - (long)(b))
 
+void
+export_snapshots(forest_t *forest, export_options_t *opts);
+
 void
 export_commits(forest_t *forest, export_options_t *opts, export_stats_t *stats);
 
+void
+export_abort(export_options_t *opts);
+
 void
 export_authors(forest_t *forest, export_options_t *opts);
 
 void
 free_author_map(void);
 
+void
+generate_revisions(generator_t *gen, void (*visit)(cvs_commit *rev));
+
+/*
+ * A snapshot is passed to the export hook as a list of IOVCNT byte
+ * spans totalling LEN bytes.  The spans may point straight into the
+ * mmapped master and are only valid for the duration of the call.
+ * With opts->packdeltas the NORIGIN line origins covering the same
+ * bytes come along too; otherwise NORIGIN is 0.
+ */
 void
 generate_files(generator_t *gen, export_options_t *opts,
-	       void (*hook)(node_t *node, void *buf, size_t len, export_options_t *popts));
+	       void (*hook)(node_t *node,
+			    const struct iovec *iov, int iovcnt, size_t len,
+			    const line_origin_t *origin, size_t norigin,
+			    export_options_t *popts));
 
 /* xnew(T) allocates aligned (packed) storage. It never returns NULL */
 #define xnew(T, legend) \
@@ -78,6 +78,96 @@ fl_put(const size_t index, file_list *fl)
     dirs[index] = fl;
 }
 
+#ifdef GITPACK
+/* a file of a revdir, by its full path */
+struct flat_entry {
+    const char		*path;
+    unsigned int	mode;
+    const unsigned char	*sha;
+};
+
+static int
+compare_flat_entry(const void *a, const void *b)
+{
+    return strcmp(((const struct flat_entry *)a)->path,
+		  ((const struct flat_entry *)b)->path);
+}
+
+static size_t
+flat_tree(const struct flat_entry *ent, const size_t n,
+	  const size_t prefixlen, unsigned char sha[SHA1_RAWSZ])
+/*
+ * Write the tree for the directory whose paths begin with the first
+ * PREFIXLEN bytes of ENT[0].path, subtrees first; return how many
+ * entries it covered.  ENT is sorted by strcmp, so every directory is
+ * one run of it.
+ */
+{
+    struct pack_tree_entry *level = NULL;
+    unsigned char (*subsha)[SHA1_RAWSZ] = NULL;
+    size_t nlevel = 0, maxlevel = 0, i = 0, k;
+
+    while (i < n && (i == 0 || strncmp(ent[i].path, ent[0].path, prefixlen) == 0)) {
+	const char *name = ent[i].path + prefixlen;
+	const char *slash = strchr(name, '/');
+
+	if (nlevel == maxlevel) {
+	    maxlevel = maxlevel ? maxlevel * 2 : 16;
+	    level = xrealloc(level, sizeof(*level) * maxlevel, __func__);
+	    subsha = xrealloc(subsha, sizeof(*subsha) * maxlevel, __func__);
+	}
+	level[nlevel].name = name;
+	if (slash == NULL) {
+	    level[nlevel].namelen = strlen(name);
+	    level[nlevel].mode = ent[i].mode;
+	    level[nlevel].sha = ent[i].sha;
+	    i++;
+	} else {
+	    level[nlevel].namelen = slash - name;
+	    level[nlevel].mode = 040000;
+	    i += flat_tree(ent + i, n - i, prefixlen + (slash - name) + 1,
+			   subsha[nlevel]);
+	}
+	nlevel++;
+    }
+    /* subsha may have moved while the level grew */
+    for (k = 0; k < nlevel; k++)
+	if (level[k].mode == 040000)
+	    level[k].sha = subsha[k];
+    pack_tree(level, nlevel, sha);
+    free(level);
+    free(subsha);
+    return i;
+}
+
+void
+revdir_tree(const revdir *revdir,
+	    const unsigned char *(*blob)(const cvs_commit *),
+	    unsigned char sha[SHA1_RAWSZ])
+/* file lists do not follow directories, so every tree is rebuilt */
+{
+    static struct flat_entry *ent;
+    static size_t maxent;
+    static revdir_iter *it;
+    size_t n = 0;
+    cvs_commit *c;
+
+    REVDIR_ITER_START(it, revdir);
+    while ((c = revdir_iter_next(it)) != NULL) {
+	if (n == maxent) {
+	    maxent = maxent ? maxent * 2 : 1024;
+	    ent = xrealloc(ent, sizeof(struct flat_entry) * maxent, __func__);
+	}
+	ent[n].path = c->master->fileop_name;
+	ent[n].mode = (c->master->mode & 0100) ? 0100755 : 0100644;
+	ent[n].sha = blob(c);
+	n++;
+    }
+    qsort(ent, n, sizeof(struct flat_entry), compare_flat_entry);
+    flat_tree(ent, n, 0, sha);
+}
+#endif /* GITPACK */
+
 void
 revdir_free(void)
 {
@@ -10,11 +10,13 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <ftw.h>
 #include <time.h>
 
 #include "cvs.h"
 #include "revdir.h"
+#include "pack.h"
+#include "sha1.h"
+#include "lz.h"
 /*
  * If a program has ever invoked pthreads, the GNU C library does extra
  * checking during stdio operations even if the program no longer has
@@ -51,11 +53,328 @@
 
 static serial_t *markmap;
 static serial_t mark;
+#ifdef GITPACK
+/* object names by mark, when writing a pack */
+static unsigned char (*marksha)[SHA1_RAWSZ];
+#endif /* GITPACK */
 static volatile int seqno;
-static char blobdir[PATH_MAX];
+
+/*
+ * In canonical order blobs are generated long before the commits that
+ * ship them, so they wait in one spool file, found by serial.  With
+ * --compress-spool a blob is stored compressed when that is smaller.
+ */
+struct spooled {
+    off_t	offset;
+    size_t	length;
+    size_t	stored;		/* less than length if compressed */
+};
+static FILE *spool;
+static off_t spoolend;
+static struct spooled *spoolmap;
+
+/*
+ * With --blob-cache canonical order does without the spool.  A blob is
+ * made when the commit that ships it is written, by running its
+ * master's generator again over the revisions still to be shipped.
+ * Those that fit the budget are kept; as commits go out in date order,
+ * the latest-dated are the first to be dropped to make room.
+ */
+struct cached {
+    cvstime_t	due;		/* revision date, 0 if wanted right now */
+    serial_t	serial;
+    size_t	slot;		/* place in the eviction heap */
+    size_t	length;
+    char	*text;
+};
+static struct cached **cachemap;	/* by serial */
+static struct cached **cacheheap;	/* latest due at the top */
+static size_t ncached, cachemax, cachesize;
+static generator_t *generators;
+static int ngenerators;
+static int *genmap;			/* generator index by serial */
+static serial_t *unshipped;		/* blobs left, by generator */
+static generator_t *counting;
+static const cvs_commit *pinned;
+static bool partial;
 
 static export_stats_t export_stats;
 
+static void writev_all(const int fd, const struct iovec *iov, int iovcnt)
+/* write out a list of spans, whatever size pieces the kernel takes */
+{
+    struct iovec chunk[64], *v;
+    int n;
+
+    while (iovcnt > 0) {
+	n = iovcnt < 64 ? iovcnt : 64;
+	memcpy(chunk, iov, n * sizeof(struct iovec));
+	iov += n;
+	iovcnt -= n;
+	for (v = chunk; n > 0; ) {
+	    ssize_t written = writev(fd, v, n);
+	    if (written < 0) {
+		if (errno == EINTR)
+		    continue;
+		fatal_system_error("writev");
+	    }
+	    /* step past what went out, allowing for partial writes */
+	    while (n > 0 && (size_t)written >= v->iov_len) {
+		written -= v->iov_len;
+		v++;
+		n--;
+	    }
+	    if (n > 0) {
+		v->iov_base = (char *)v->iov_base + written;
+		v->iov_len -= written;
+	    }
+	}
+    }
+}
+
+/*
+ * The stream goes out through a buffer of its own rather than stdio,
+ * with numbers formatted by hand and one write(2) per flush.  Whatever
+ * is buffered when the program exits, even on a fatal error, is
+ * flushed as stdio would have done.
+ */
+#define OUT_BUFSIZE	(4 * 1024 * 1024)
+static char *outbuf;
+static size_t outlen;
+
+/*
+ * With --checkpoint the stream is hashed on its way out.  At commit
+ * boundaries, every CHECKPOINT_INTERVAL bytes and after the blobs of
+ * a fast-order stream, the importer is sent a checkpoint command and
+ * the length and digest of the stream so far replace the checkpoint
+ * file.  --resume runs the conversion again and discards its stream
+ * up to the recorded length, then checks the digest before writing
+ * anything.  If the blobs were all out, they are numbered but not
+ * generated, and the hash picks up from its state after them.
+ *
+ * The file holds the magic, a version, then the fields below in
+ * order, integers most significant byte first.
+ */
+#define CHECKPOINT_INTERVAL	(64 * 1024 * 1024)
+#define CHECKPOINT_MAGIC	"cfeckpt"	/* 8 bytes with the NUL */
+#define CHECKPOINT_VERSION	1
+#define CHECKPOINT_SIZE	(8 + 4 + 8 + SHA1_RAWSZ + 8 + SHA1_SAVESZ)
+struct resume_point {
+    uint64_t		length;		/* bytes of stream shipped */
+    unsigned char	digest[SHA1_RAWSZ];	/* of those bytes */
+    uint64_t		blobs;		/* where fast-order blobs ended, or 0 */
+    sha1_ctx		blobhash;	/* hash state at that point */
+};
+static sha1_ctx streamhash;
+static uint64_t streamed, lastcheck;
+static struct resume_point here_point;	/* what the next checkpoint saves */
+static struct resume_point resume;	/* what --resume read; length 0 if none */
+static bool checkpointing;
+
+static void resume_check(void)
+/* the replayed stream has reached the resume point; is it the same? */
+{
+    sha1_ctx ctx = streamhash;
+    unsigned char digest[SHA1_RAWSZ];
+
+    sha1_final(&ctx, digest);
+    if (memcmp(digest, resume.digest, SHA1_RAWSZ) != 0)
+	fatal_error("stream differs from the checkpointed conversion");
+}
+
+static void out_write(const struct iovec *iov, int iovcnt)
+/* send spans to standard output; all the stream goes this way */
+{
+    struct iovec trimmed[64];
+    int i, n = 0;
+
+    if (!checkpointing) {
+	writev_all(STDOUT_FILENO, iov, iovcnt);
+	return;
+    }
+    for (i = 0; i < iovcnt; i++) {
+	const char *base = iov[i].iov_base;
+	size_t len = iov[i].iov_len, skip = 0;
+
+	sha1_update(&streamhash, base, len);
+	/* what the importer already has is dropped */
+	if (streamed < resume.length) {
+	    skip = resume.length - streamed;
+	    if (skip > len)
+		skip = len;
+	}
+	streamed += len;
+	if (skip > 0 && streamed >= resume.length)
+	    resume_check();
+	if (skip < len) {
+	    trimmed[n].iov_base = (char *)base + skip;
+	    trimmed[n].iov_len = len - skip;
+	    if (++n == 64) {
+		writev_all(STDOUT_FILENO, trimmed, n);
+		n = 0;
+	    }
+	}
+    }
+    writev_all(STDOUT_FILENO, trimmed, n);
+}
+
+static void out_flush(void)
+{
+    struct iovec v = {outbuf, outlen};
+
+    /* the exit handler must not try again if this fails */
+    outlen = 0;
+    out_write(&v, 1);
+}
+
+static void out_begin(void)
+{
+    if (outbuf == NULL) {
+	outbuf = xmalloc(OUT_BUFSIZE, "output buffer");
+	atexit(out_flush);
+    }
+}
+
+static void out_bytes(const void *data, const size_t len)
+{
+    if (outlen + len > OUT_BUFSIZE) {
+	out_flush();
+	if (len > OUT_BUFSIZE) {
+	    struct iovec v = {(void *)data, len};
+	    out_write(&v, 1);
+	    return;
+	}
+    }
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+}
+
+static void out_str(const char *s)
+{
+    /* an unnamed branch has always come out as printf shows NULL */
+    if (s == NULL)
+	s = "(null)";
+    out_bytes(s, strlen(s));
+}
+
+static void out_char(const char c)
+{
+    if (outlen == OUT_BUFSIZE)
+	out_flush();
+    outbuf[outlen++] = c;
+}
+
+static void out_number(unsigned long n, const unsigned int base)
+/* N in decimal or octal, no padding */
+{
+    char digits[24], *p = digits + sizeof(digits);
+
+    do {
+	*--p = '0' + n % base;
+	n /= base;
+    } while (n > 0);
+    out_bytes(p, digits + sizeof(digits) - p);
+}
+
+static unsigned char *put_be(unsigned char *p, const uint64_t v, int n)
+/* store the low N bytes of V, most significant first */
+{
+    while (n-- > 0)
+	*p++ = (unsigned char)(v >> (8 * n));
+    return p;
+}
+
+static uint64_t get_be(const unsigned char **pp, int n)
+/* fetch an N-byte integer stored by put_be() */
+{
+    uint64_t v = 0;
+
+    while (n-- > 0)
+	v = v << 8 | *(*pp)++;
+    return v;
+}
+
+static void checkpoint_load(const export_options_t *opts)
+/* pick up where the last run left off, if it got to a checkpoint */
+{
+    unsigned char buf[CHECKPOINT_SIZE];
+    const unsigned char *p = buf + sizeof(CHECKPOINT_MAGIC);
+    FILE *fp;
+
+    checkpointing = true;
+    sha1_init(&streamhash);
+    if (!opts->resume)
+	return;
+    if ((fp = fopen(opts->checkpoint, "rb")) == NULL) {
+	/* it died before the first checkpoint, so start over */
+	if (errno == ENOENT)
+	    return;
+	fatal_system_error("cannot read checkpoint %s", opts->checkpoint);
+    }
+    if (fread(buf, 1, sizeof(CHECKPOINT_MAGIC), fp) != sizeof(CHECKPOINT_MAGIC)
+	|| memcmp(buf, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+	fatal_error("%s is not a checkpoint", opts->checkpoint);
+    if (fread(buf + sizeof(CHECKPOINT_MAGIC), 1, 4, fp) != 4
+	|| get_be(&p, 4) != CHECKPOINT_VERSION)
+	fatal_error("%s is not a version %d checkpoint",
+		    opts->checkpoint, CHECKPOINT_VERSION);
+    if (fread(buf + sizeof(CHECKPOINT_MAGIC) + 4, 1,
+	      CHECKPOINT_SIZE - sizeof(CHECKPOINT_MAGIC) - 4, fp)
+	    != CHECKPOINT_SIZE - sizeof(CHECKPOINT_MAGIC) - 4)
+	fatal_error("%s is truncated", opts->checkpoint);
+    (void)fclose(fp);
+    resume.length = get_be(&p, 8);
+    memcpy(resume.digest, p, SHA1_RAWSZ);
+    p += SHA1_RAWSZ;
+    resume.blobs = get_be(&p, 8);
+    sha1_restore(&resume.blobhash, p);
+    here_point = resume;
+}
+
+static void checkpoint_save(const export_options_t *opts, const bool blobs_end)
+/* have the importer make its state durable, then record ours */
+{
+    unsigned char buf[CHECKPOINT_SIZE], *p = buf;
+    char tmp[PATH_MAX];
+    sha1_ctx ctx;
+    FILE *fp;
+
+    out_str("checkpoint\n");
+    out_flush();
+    lastcheck = streamed;
+    if (blobs_end) {
+	here_point.blobs = streamed;
+	here_point.blobhash = streamhash;
+    }
+    /* a replay adds nothing until it passes the resume point */
+    if (streamed <= resume.length)
+	return;
+    here_point.length = streamed;
+    ctx = streamhash;
+    sha1_final(&ctx, here_point.digest);
+
+    memcpy(p, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    p = put_be(p + sizeof(CHECKPOINT_MAGIC), CHECKPOINT_VERSION, 4);
+    p = put_be(p, here_point.length, 8);
+    memcpy(p, here_point.digest, SHA1_RAWSZ);
+    p = put_be(p + SHA1_RAWSZ, here_point.blobs, 8);
+    sha1_save(&here_point.blobhash, p);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", opts->checkpoint);
+    if ((fp = fopen(tmp, "wb")) == NULL
+	|| fwrite(buf, sizeof(buf), 1, fp) != 1
+	|| fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0
+	|| rename(tmp, opts->checkpoint) != 0)
+	fatal_system_error("cannot write checkpoint %s", opts->checkpoint);
+}
+
+static void checkpoint_maybe(const export_options_t *opts)
+/* called between commits */
+{
+    if (checkpointing && streamed + outlen - lastcheck >= CHECKPOINT_INTERVAL)
+	checkpoint_save(opts, false);
+}
+
 static int seqno_next(void)
 /* Returns next sequence number, starting with 1 */
 {
@@ -67,62 +386,444 @@ static int seqno_next(void)
     return seqno;
 }
 
-static char *blobfile(const char *basename,
-		      const int serial,
-		      const bool create, char *path)
-/* Random-access location of the blob corresponding to the specified serial */
+static void open_spool(void)
+/* the spool is unlinked at once, so it goes away however we exit */
 {
-    int m;
+    char *tmp = getenv("TMPDIR"), path[PATH_MAX];
+    int fd;
+
+    if (tmp == NULL) 
+	tmp = "/tmp";
+    snprintf(path, sizeof(path), "%s/cvs-fast-export-XXXXXX", tmp);
+    if ((fd = mkstemp(path)) < 0 || (spool = fdopen(fd, "w+")) == NULL)
+	fatal_system_error("blob spool creation in %s failed", tmp);
+    (void)unlink(path);
+    setvbuf(spool, NULL, _IOFBF, 1024 * 1024);
+    spoolend = 0;
+}
 
-#ifdef FDEBUG
-    (void)fprintf(stderr, "-> blobfile(%d, %d)...\n", serial, create);
-#endif /* FDEBUG */
-    (void)snprintf(path, PATH_MAX, "%s", blobdir);
-    /*
-     * FANOUT should be chosen to be the largest directory size that does not
-     * cause slow secondary allocations.  It's something near 256 on ext4
-     * (we think...)
-     */
-#define FANOUT	256
-    for (m = serial;;)
-    {
-	int digit = m % FANOUT;
-	if ((m = (m - digit) / FANOUT) == 0) {
-	    (void)snprintf(path + strlen(path), PATH_MAX - strlen(path),
-			   "/=%x", digit);
-#ifdef FDEBUG
-	    (void)fprintf(stderr, "path: %s\n", path);
-#endif /* FDEBUG */
-	    break;
+static void ship_spooled(const struct spooled *sp, const serial_t mark)
+/* copy a spooled blob to the output */
+{
+    char buf[64 * 1024];
+    off_t at = sp->offset;
+    size_t left = sp->stored;
+
+    out_str("blob\nmark :");
+    out_number(mark, 10);
+    out_str("\ndata ");
+    out_number(sp->length, 10);
+    out_char('\n');
+    if (sp->stored < sp->length) {
+	static unsigned char *packed, *text;
+	static size_t packedmax, textmax;
+
+	if (sp->stored > packedmax) {
+	    packedmax = sp->stored;
+	    packed = xrealloc(packed, packedmax, "spool read-back");
 	}
-	else
-	{
-	    (void)snprintf(path + strlen(path), PATH_MAX - strlen(path),
-			   "/%x", digit);
-	    /* coverity[toctou] */
-#ifdef FDEBUG
-	    (void)fprintf(stderr, "directory: %s\n", path);
-#endif /* FDEBUG */
-	    if (create && access(path, R_OK) != 0) {
-#ifdef FDEBUG
-		(void)fprintf(stderr, "directory: %s\n", path);
-#endif /* FDEBUG */
-		errno = 0;
-		if (mkdir(path,S_IRWXU | S_IRWXG) != 0 && errno != EEXIST)
-		    fatal_error("blob subdir creation of %s failed: %s (%d)\n", path, strerror(errno), errno);
+	if (sp->length > textmax) {
+	    textmax = sp->length;
+	    text = xrealloc(text, textmax, "spool read-back");
+	}
+	while (left > 0) {
+	    ssize_t n = pread(fileno(spool), packed + (sp->stored - left),
+			      left, at);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		fatal_system_error("blob spool read failed");
+	    at += n;
+	    left -= n;
+	}
+	if (!lz_decompress(packed, sp->stored, text, sp->length))
+	    fatal_error("blob spool is damaged at offset %ld",
+			(long)sp->offset);
+	out_bytes(text, sp->length);
+	out_char('\n');
+	return;
+    }
+    while (left > 0) {
+	ssize_t n = pread(fileno(spool), buf,
+			  left < sizeof(buf) ? left : sizeof(buf), at);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    fatal_system_error("blob spool read failed");
+	out_bytes(buf, n);
+	at += n;
+	left -= n;
+    }
+    out_char('\n');
+}
+
+static void spool_compressed(struct spooled *sp,
+			     const struct iovec *iov, int iovcnt,
+			     const size_t len)
+/* spool a snapshot compressed, or as it is if that is no bigger */
+{
+    static unsigned char *flat, *packed;
+    static size_t flatmax, packedmax;
+    const unsigned char *text;
+    size_t stored;
+    int i;
+
+    if (iovcnt == 1)
+	text = iov[0].iov_base;
+    else {
+	size_t at = 0;
+	if (len > flatmax) {
+	    flatmax = len;
+	    flat = xrealloc(flat, flatmax, "spool compression");
+	}
+	for (i = 0; i < iovcnt; i++) {
+	    memcpy(flat + at, iov[i].iov_base, iov[i].iov_len);
+	    at += iov[i].iov_len;
+	}
+	text = flat;
+    }
+    if (LZ_BOUND(len) > packedmax) {
+	packedmax = LZ_BOUND(len);
+	packed = xrealloc(packed, packedmax, "spool compression");
+    }
+    stored = lz_compress(text, len, packed);
+    if (stored < len) {
+	sp->stored = stored;
+	fwrite(packed, 1, stored, spool);
+    } else {
+	sp->stored = len;
+	fwrite(text, 1, len, spool);
+    }
+}
+
+static void heap_place(struct cached *cp, const size_t slot)
+{
+    cacheheap[slot] = cp;
+    cp->slot = slot;
+}
+
+static void heap_sift(size_t slot)
+/* move the entry at SLOT up or down to its place in the heap */
+{
+    struct cached *cp = cacheheap[slot];
+
+    while (slot > 0 && cacheheap[(slot - 1) / 2]->due < cp->due) {
+	heap_place(cacheheap[(slot - 1) / 2], slot);
+	slot = (slot - 1) / 2;
+    }
+    for (;;) {
+	size_t child = 2 * slot + 1;
+	if (child >= ncached)
+	    break;
+	if (child + 1 < ncached
+		&& cacheheap[child + 1]->due > cacheheap[child]->due)
+	    child++;
+	if (cacheheap[child]->due <= cp->due)
+	    break;
+	heap_place(cacheheap[child], slot);
+	slot = child;
+    }
+    heap_place(cp, slot);
+}
+
+static void uncache(struct cached *cp)
+{
+    const size_t slot = cp->slot;
+
+    cachemap[cp->serial] = NULL;
+    cachesize -= cp->length;
+    if (slot != --ncached) {
+	heap_place(cacheheap[ncached], slot);
+	heap_sift(slot);
+    }
+    free(cp);
+}
+
+static void cache_blob(node_t *node,
+		       const struct iovec *iov, int iovcnt, const size_t len,
+		       const line_origin_t *origin, size_t norigin,
+		       export_options_t *opts)
+/* keep a regenerated snapshot if it is due before what it displaces */
+{
+    const cvs_commit *rev = node->commit;
+    const cvstime_t due = rev == pinned ? 0 : rev->date;
+    struct cached *cp;
+    size_t at = 0;
+    int i;
+
+    if (rev != pinned && len > opts->blobcache)
+	return;
+    while (ncached > 0 && cachesize + len > opts->blobcache
+	   && cacheheap[0]->due > due)
+	uncache(cacheheap[0]);
+    if (rev != pinned && cachesize + len > opts->blobcache)
+	return;
+
+    cp = xmalloc(sizeof(struct cached) + len, "blob cache");
+    cp->text = (char *)(cp + 1);
+    for (i = 0; i < iovcnt; i++) {
+	memcpy(cp->text + at, iov[i].iov_base, iov[i].iov_len);
+	at += iov[i].iov_len;
+    }
+    cp->due = due;
+    cp->serial = rev->serial;
+    cp->length = len;
+    cachemap[rev->serial] = cp;
+    cachesize += len;
+    if (ncached >= cachemax) {
+	cachemax = cachemax ? cachemax * 2 : 1024;
+	cacheheap = xrealloc(cacheheap, cachemax * sizeof(struct cached *),
+			     "blob cache");
+    }
+    heap_place(cp, ncached++);
+    heap_sift(cp->slot);
+}
+
+static void mark_unshipped(cvs_commit *rev)
+{
+    rev->wanted = rev->serial != 0 && !rev->emitted
+	&& cachemap[rev->serial] == NULL;
+}
+
+static void ship_cached(cvs_commit *rev, const serial_t mark,
+			const export_options_t *opts)
+/* write a blob from the cache, generating it again if it is not there */
+{
+    struct cached *cp = cachemap[rev->serial];
+    generator_t *gen = generators + genmap[rev->serial];
+
+    if (cp == NULL) {
+	pinned = rev;
+	generate_revisions(gen, mark_unshipped);
+	generate_files(gen, (export_options_t *)opts, cache_blob);
+	pinned = NULL;
+	cp = cachemap[rev->serial];
+	assert(cp != NULL);
+    }
+    out_str("blob\nmark :");
+    out_number(mark, 10);
+    out_str("\ndata ");
+    out_number(cp->length, 10);
+    out_char('\n');
+    out_bytes(cp->text, cp->length);
+    out_char('\n');
+    export_stats.snapsize += cp->length;
+    uncache(cp);
+    if (--unshipped[gen - generators] == 0)
+	generator_free(gen);
+}
+
+static void count_revision(cvs_commit *rev)
+/* give a serial to each snapshot the generator would emit */
+{
+    if (rev->dead || (partial && !rev->wanted))
+	return;
+    rev->serial = seqno_next();
+    genmap[rev->serial] = counting - generators;
+    unshipped[counting - generators]++;
+}
+
+/*
+ * A marks file lets a later run leave out what an importer already has.
+ * It has a line "B <mark> <revision> <path>" for each blob and
+ * "C <mark> <key>" for each commit.  The key is a SHA-1 over the key of
+ * the parent, the (path, revision) pairs the commit changes, and its
+ * author, log and date, so a commit that collates the same way again
+ * gets the same key.  Blobs and commits found in the imported file
+ * keep their marks and are not shipped; new marks continue above the
+ * largest imported.  Both kinds are looked up in one table by digest.
+ */
+struct known_mark {
+    unsigned char	key[SHA1_RAWSZ];
+    serial_t		mark;		/* 0 in an empty slot */
+};
+static struct known_mark *known;
+static size_t knownmask, nknown;
+static unsigned char (*commitkey)[SHA1_RAWSZ];	/* by serial */
+static FILE *markfile;
+static char markfile_tmp[PATH_MAX];
+
+static struct known_mark *known_slot(const unsigned char key[SHA1_RAWSZ])
+/* the slot holding KEY, or the empty one where it would go */
+{
+    size_t i;
+
+    memcpy(&i, key, sizeof(i));
+    for (i &= knownmask; known[i].mark != 0; i = (i + 1) & knownmask)
+	if (memcmp(known[i].key, key, SHA1_RAWSZ) == 0)
+	    break;
+    return &known[i];
+}
+
+static void remember_mark(const unsigned char key[SHA1_RAWSZ],
+			  const serial_t oldmark)
+/* the importer has what KEY names as OLDMARK */
+{
+    struct known_mark *slot;
+
+    if (known == NULL) {
+	knownmask = 1023;
+	known = xcalloc(knownmask + 1, sizeof(struct known_mark), "marks table");
+    }
+    slot = known_slot(key);
+    if (slot->mark == 0 && ++nknown * 2 > knownmask) {
+	struct known_mark *old = known;
+	size_t oldmask = knownmask, i;
+
+	knownmask = knownmask * 2 + 1;
+	known = xcalloc(knownmask + 1, sizeof(struct known_mark), "marks table");
+	for (i = 0; i <= oldmask; i++)
+	    if (old[i].mark != 0)
+		*known_slot(old[i].key) = old[i];
+	free(old);
+	slot = known_slot(key);
+    }
+    memcpy(slot->key, key, SHA1_RAWSZ);
+    slot->mark = oldmark;
+}
+
+static serial_t known_mark(const unsigned char key[SHA1_RAWSZ])
+/* the imported mark for KEY, or 0 */
+{
+    return known == NULL ? 0 : known_slot(key)->mark;
+}
+
+static void blob_key(const char *revision, const char *path,
+		     unsigned char key[SHA1_RAWSZ])
+/* the key of a blob, by the master it is from */
+{
+    sha1_ctx ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, "B", 1);
+    sha1_update(&ctx, revision, strlen(revision) + 1);
+    sha1_update(&ctx, path, strlen(path));
+    sha1_final(&ctx, key);
+}
+
+static void note_blob(const cvs_commit *rev)
+/* add a blob to the exported marks */
+{
+    char revision[CVS_MAX_REV_LEN];
+
+    if (markfile == NULL)
+	return;
+    cvs_number_string(rev->number, revision, sizeof(revision));
+    fprintf(markfile, "B %lu %s %s\n",
+	    (unsigned long)markmap[rev->serial], revision,
+	    rev->master->fileop_name);
+}
+
+static void import_marks(const export_options_t *opts)
+/* read the marks a previous run exported */
+{
+    char line[PATH_MAX + CVS_MAX_REV_LEN + 64];
+    unsigned char key[SHA1_RAWSZ];
+    FILE *fp;
+    int lineno = 0;
+
+    if ((fp = fopen(opts->import_marks, "r")) == NULL)
+	fatal_system_error("cannot read marks file %s", opts->import_marks);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	unsigned long oldmark;
+	char *cp, *end;
+	size_t len = strlen(line);
+
+	lineno++;
+	if (len > 0 && line[len - 1] == '\n')
+	    line[--len] = '\0';
+	if (len < 4 || (line[0] != 'B' && line[0] != 'C') || line[1] != ' '
+	    || (oldmark = strtoul(line + 2, &end, 10)) == 0
+	    || *end != ' ' || oldmark >= MAX_SERIAL_T)
+	    fatal_error("%s, line %d: malformed mark", opts->import_marks, lineno);
+	cp = end + 1;
+	if (line[0] == 'B') {
+	    char *path = strchr(cp, ' ');
+	    if (path == NULL)
+		fatal_error("%s, line %d: malformed mark",
+			    opts->import_marks, lineno);
+	    *path++ = '\0';
+	    blob_key(cp, path, key);
+	} else {
+	    int i;
+	    for (i = 0; i < SHA1_RAWSZ; i++) {
+		unsigned int byte;
+		if (sscanf(cp + 2 * i, "%2x", &byte) != 1)
+		    fatal_error("%s, line %d: malformed mark",
+				opts->import_marks, lineno);
+		key[i] = byte;
 	    }
 	}
+	remember_mark(key, (serial_t)oldmark);
+	if (oldmark > mark)
+	    mark = oldmark;
+    }
+    if (ferror(fp))
+	fatal_system_error("cannot read marks file %s", opts->import_marks);
+    (void)fclose(fp);
+}
+
+static void claim_revision(cvs_commit *rev)
+/* number a blob the importer already has, or ask for it to be made */
+{
+    char revision[CVS_MAX_REV_LEN];
+    unsigned char key[SHA1_RAWSZ];
+    serial_t oldmark;
+
+    if (rev->dead)
+	return;
+    cvs_number_string(rev->number, revision, sizeof(revision));
+    blob_key(revision, rev->master->fileop_name, key);
+    if ((oldmark = known_mark(key)) != 0) {
+	rev->serial = seqno_next();
+	markmap[rev->serial] = oldmark;
+	rev->emitted = true;
+	rev->wanted = false;
+	note_blob(rev);
+    } else
+	rev->wanted = true;
+}
+
+/*
+ * Blob bodies at least this big are written with writev(2) straight
+ * from the generator's spans rather than copied through a buffer.
+ */
+#define DIRECT_WRITE_THRESHOLD	(64 * 1024)
+
+static void write_spans(FILE *fp,
+			const struct iovec *iov, int iovcnt, const size_t len)
+/* write a snapshot given as a list of spans */
+{
+    int i;
+
+    if (len < DIRECT_WRITE_THRESHOLD) {
+	for (i = 0; i < iovcnt; i++)
+	    fwrite(iov[i].iov_base, iov[i].iov_len, sizeof(char), fp);
+	return;
     }
-#undef FANOUT
-#ifdef FDEBUG
-    (void)fprintf(stderr, "<- ...returned path for %s %d = %s\n",
-		  basename, serial, path);
-#endif /* FDEBUG */
-    return path;
+
+    fflush(fp);
+    writev_all(fileno(fp), iov, iovcnt);
+}
+
+static void out_spans(const struct iovec *iov, int iovcnt, const size_t len)
+/* write a snapshot given as a list of spans to the stream */
+{
+    int i;
+
+    if (len < DIRECT_WRITE_THRESHOLD) {
+	for (i = 0; i < iovcnt; i++)
+	    out_bytes(iov[i].iov_base, iov[i].iov_len);
+	return;
+    }
+
+    out_flush();
+    out_write(iov, iovcnt);
 }
 
 static void export_blob(node_t *node, 
-			void *buf, const size_t len,
+			const struct iovec *iov, int iovcnt, const size_t len,
+			const line_origin_t *origin, size_t norigin,
 			export_options_t *opts)
 /* output the blob, or save where it will be available for random access */
 {
@@ -131,75 +832,89 @@ static void export_blob(node_t *node,
     node->commit->serial = seqno_next();
     if (opts->reportmode == fast) {
 	markmap[node->commit->serial] = ++mark;
-	printf("blob\nmark :%d\n", (int)mark);
-	fprintf(stdout, "data %lu\n", (unsigned long)len);
-	fwrite(buf, len, sizeof(char), stdout);
-	fputc('\n', stdout);
+	note_blob(node->commit);
+#ifdef GITPACK
+	if (opts->packdir != NULL) {
+	    pack_blob(iov, iovcnt, len, origin, norigin, marksha[mark]);
+	    return;
+	}
+#endif /* GITPACK */
+	out_str("blob\nmark :");
+	out_number(mark, 10);
+	out_str("\ndata ");
+	out_number(len, 10);
+	out_char('\n');
+	out_spans(iov, iovcnt, len);
+	out_char('\n');
     }
     else
     {
-	FILE *wfp;
-
-	char path[PATH_MAX];
-	blobfile(node->commit->master->name, node->commit->serial, true, path);
-	wfp = fopen(path, "w");
+	struct spooled *sp = &spoolmap[node->commit->serial];
 
-	if (wfp == NULL)
-	    fatal_error("blobfile open of %s: %s (%d)", 
-			path, strerror(errno), errno);
-	fprintf(wfp, "data %lu\n", (unsigned long)len);
-	fwrite(buf, len, sizeof(char), wfp);
-	fputc('\n', wfp);
-	(void)fclose(wfp);
+	sp->offset = spoolend;
+	sp->length = sp->stored = len;
+	if (opts->compress_spool && len > 0)
+	    spool_compressed(sp, iov, iovcnt, len);
+	else
+	    write_spans(spool, iov, iovcnt, len);
+	spoolend += sp->stored;
     }
 }
 
-static int unlink_cb(const char *fpath, 
-		     const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+static void number_revision(cvs_commit *rev)
+/* what export_blob() does in fast mode, for a blob already shipped */
 {
-    int rv = remove(fpath);
-
-    if (rv)
-        perror(fpath);
-
-    return rv;
+    if (!rev->dead && (!partial || rev->wanted)) {
+	rev->serial = seqno_next();
+	markmap[rev->serial] = ++mark;
+	note_blob(rev);
+    }
 }
 
 static void cleanup(const export_options_t *opts)
 {
-    if (opts->reportmode == canonical)
-        nftw(blobdir, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
-}
-
-static const char *utc_offset_timestamp(const time_t *timep, const char *tz)
-{
-    static char outbuf[BUFSIZ];
-    struct tm *tm;
-    char tzbuf[BUFSIZ];
-    /* coverity[tainted_string_return_content] */
-    char *oldtz = getenv("TZ");
-
-    // make a copy in case original is clobbered
-    if (oldtz != NULL)
-	strncpy(tzbuf, oldtz, sizeof(tzbuf)-1);
-
-    setenv("TZ", tz, 1);
-    tzset();  // just in case ...
-
-    tm = localtime(timep);
-#ifndef __CYGWIN__
-    strftime(outbuf, sizeof(outbuf), "%s %z", tm);
-#else
-		// Cygdwin doesn't have %s for strftime
-    int x = sprintf(outbuf, "%li", *timep);
-    strftime(outbuf + x, sizeof(outbuf) - x, " %z", tm);
-#endif
-    if (oldtz != NULL)
-	setenv("TZ", tzbuf, 1);
-    else
-	unsetenv("TZ");
-    tzset();
+    if (opts->reportmode == canonical && spool != NULL) {
+	(void)fclose(spool);
+	spool = NULL;
+	free(spoolmap);
+	spoolmap = NULL;
+    }
+    if (opts->blobcache > 0) {
+	int i;
+
+	/* incremental dumps can leave blobs that were never shipped */
+	while (ncached > 0)
+	    uncache(cacheheap[0]);
+	for (i = 0; i < ngenerators; i++)
+	    if (unshipped[i] > 0)
+		generator_free(generators + i);
+	free(cacheheap);
+	free(cachemap);
+	free(genmap);
+	free(unshipped);
+	cacheheap = cachemap = NULL;
+	genmap = NULL;
+	unshipped = NULL;
+	ncached = cachemax = cachesize = 0;
+    }
+}
+
+static const char *utc_offset_timestamp(const time_t *timep,
+					const cvs_author *author)
+/* a date as git wants it, seconds since the epoch and offset from UTC */
+{
+    static char outbuf[64];
+    long offset = utc_offset(author, *timep);
+    char sign = '+';
 
+    if (offset < 0) {
+	sign = '-';
+	offset = -offset;
+    }
+    /* like strftime's %z, which drops any seconds */
+    offset /= 60;
+    snprintf(outbuf, sizeof(outbuf), "%lld %c%04ld",
+	     (long long)*timep, sign, (offset / 60) * 100 + offset % 60);
     return outbuf;
 }
 
@@ -237,16 +952,25 @@ static void dump_commit(const git_commit *commit, FILE *fp)
 #endif /* ORDERDEBUG */
 
 
+/*
+ * Scratch space kept from one commit to the next, so the common case
+ * allocates nothing: the operations against the parent, and the
+ * revision pairs text with its length.
+ */
+static struct fileop *operations;
+static int noperations;
+static char *revpairs;
+static size_t revpairslen, revpairsize;
+
 static struct fileop *
-next_op_slot(struct fileop **operations, struct fileop *op, int *noperations)
+next_op_slot(struct fileop *op)
 /* move to next operations slot, expand if necessary */
 {
-#define OP_CHUNK	32
-    if (++op == (*operations) + (*noperations)) {
-	(*noperations) += OP_CHUNK;
-	*operations = xrealloc(*operations, sizeof(struct fileop) * (*noperations), __func__);
+    if (++op == operations + noperations) {
+	noperations *= 2;
+	operations = xrealloc(operations, sizeof(struct fileop) * noperations, __func__);
 	// realloc can move operations
-	op = (*operations) + (*noperations) - OP_CHUNK;
+	op = operations + noperations / 2;
     }
     return op;
 }
@@ -265,22 +989,26 @@ build_modify_op(cvs_commit *c, struct fileop *op)
 }
 
 static void
-append_revpair(cvs_commit *c, const export_options_t *opts,
-	       char **revpairs, size_t *revpairsize)
+append_revpair(cvs_commit *c, const export_options_t *opts)
 /* append file information if requested */
 {
     if (opts->revision_map || opts->reposurgeon || opts->embed_ids) {
 	char fr[BUFSIZ];
-	int xtr = opts->embed_ids ? 10 : 2;
+	const char *prefix = opts->embed_ids ? "CVS-ID: " : "";
+	size_t prefixlen = strlen(prefix), frlen;
 	stringify_revision(c->master->name, " ", c->number, fr, sizeof fr);
-	if (strlen(*revpairs) + strlen(fr) + xtr > *revpairsize) {
-	    *revpairsize *= 2;
-	    *revpairs = xrealloc(*revpairs, *revpairsize, "revpair allocation");
+	frlen = strlen(fr);
+	/* room for the newline and the terminating NUL */
+	while (revpairslen + prefixlen + frlen + 2 > revpairsize) {
+	    revpairsize *= 2;
+	    revpairs = xrealloc(revpairs, revpairsize, "revpair allocation");
 	}
-	if (opts->embed_ids)
-	    strcat(*revpairs, "CVS-ID: ");
-	strcat(*revpairs, fr);
-	strcat(*revpairs, "\n");
+	memcpy(revpairs + revpairslen, prefix, prefixlen);
+	revpairslen += prefixlen;
+	memcpy(revpairs + revpairslen, fr, frlen);
+	revpairslen += frlen;
+	revpairs[revpairslen++] = '\n';
+	revpairs[revpairslen] = '\0';
     }
 }
 
@@ -293,34 +1021,19 @@ build_delete_op(cvs_commit *c, struct fileop *op)
     op->op = 'D';
     op->path = c->master->fileop_name;
 }
-static void
-export_commit(git_commit *commit, const char *branch,
-	      const bool report, const export_options_t *opts)
-/* export a commit and the blobs it is the first to reference */
+static struct fileop *
+build_fileops(const git_commit *commit)
+/* diff a commit against its parent into operations; return the end */
 {
     const git_commit *parent = commit->parent;
+    struct fileop *op;
     cvs_commit *cc;
-    cvs_author *author;
-    const char *full;
-    const char *email;
-    const char *timezone;
-    char *revpairs = NULL;
-    size_t revpairsize = 0;
-    time_t ct;
-    struct fileop *operations, *op, *op2;
-    int noperations;
-    serial_t here;
-    static const char *s_gitignore;
 
-    if (!s_gitignore) s_gitignore = atom(".gitignore");
-
-    if (opts->reposurgeon || opts->revision_map || opts->embed_ids) {
-	revpairs = xmalloc((revpairsize = 1024), "revpair allocation");
-	revpairs[0] = '\0';
+    if (operations == NULL) {
+	noperations = 32;
+	operations = xmalloc(sizeof(struct fileop) * noperations, "fileop allocation");
     }
-
-    noperations = OP_CHUNK;
-    op = operations = xmalloc(sizeof(struct fileop) * noperations, "fileop allocation");
+    op = operations;
 
     /* Perform a merge join between files in commit and files in parent commit
      * to determine modified (including new) and deleted files  between commits.
@@ -354,8 +1067,7 @@ export_commit(git_commit *commit, const char *branch,
 	    if (pc->master == cc->master) {
 		/* file exists in commit and parent, but different revisions, modify op */
 		build_modify_op(cc, op);
-		append_revpair(cc, opts, &revpairs, &revpairsize);
-		op = next_op_slot(&operations, op, &noperations);
+		op = next_op_slot(op);
 		pc = revdir_iter_next(parent_iter);
 		cc = revdir_iter_next(commit_iter);
 		continue;
@@ -364,50 +1076,276 @@ export_commit(git_commit *commit, const char *branch,
 	    if (pc->master < cc->master) {
 		/* parent but no child, delete op */
 		build_delete_op(pc, op);
-		op = next_op_slot(&operations, op, &noperations);
+		op = next_op_slot(op);
 		pc = revdir_iter_next(parent_iter);
 	    } else {
 		/* child but no parent, modify op */
 		build_modify_op(cc, op);
-		append_revpair(cc, opts, &revpairs, &revpairsize);
-		op = next_op_slot(&operations, op, &noperations);
+		op = next_op_slot(op);
 		cc = revdir_iter_next(commit_iter);
 	    }
 	}
 	for (; pc; pc = revdir_iter_next(parent_iter)) {
 	    /* parent but no child, delete op */
 	    build_delete_op(pc, op);
-	    op = next_op_slot(&operations, op, &noperations);
+	    op = next_op_slot(op);
 	}
     }
     for (; cc; cc = revdir_iter_next(commit_iter)) {
 	/* child but no parent, modify op */
 	build_modify_op(cc, op);
-	append_revpair(cc, opts, &revpairs, &revpairsize);
-	op = next_op_slot(&operations, op, &noperations);
+	op = next_op_slot(op);
+    }
+
+    return op;
+}
+
+static void commit_key(const git_commit *commit, const struct fileop *end,
+		       unsigned char key[SHA1_RAWSZ])
+/* the key of a commit whose operations end at END */
+{
+    static const unsigned char root[SHA1_RAWSZ];
+    char buf[CVS_MAX_REV_LEN + 32];
+    const struct fileop *op;
+    sha1_ctx ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, commit->parent != NULL
+		? commitkey[commit->parent->serial] : root, SHA1_RAWSZ);
+    for (op = operations; op < end; op++) {
+	sha1_update(&ctx, &op->op, 1);
+	sha1_update(&ctx, op->path, strlen(op->path) + 1);
+	if (op->op == 'M') {
+	    cvs_number_string(op->rev->number, buf, sizeof(buf));
+	    sha1_update(&ctx, buf, strlen(buf) + 1);
+	}
+    }
+    sha1_update(&ctx, commit->author, strlen(commit->author) + 1);
+    sha1_update(&ctx, commit->log, strlen(commit->log) + 1);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)commit->date);
+    sha1_update(&ctx, buf, strlen(buf));
+    sha1_final(&ctx, key);
+}
+
+static void
+mark_wanted(git_repo *rl, const export_options_t *opts)
+/* flag the revisions whose snapshots an incremental dump will ship */
+{
+    struct fileop *op, *op2;
+    rev_ref *h;
+    git_commit *c;
+
+    for (h = rl->heads; h; h = h->next) {
+	if (h->tail)
+	    continue;
+	/* PUNNING: see the big comment in cvs.h */
+	for (c = (git_commit *)h->commit; c; c = (c->tail ? NULL : c->parent)) {
+	    /* forced dates depend on export order; keep everything */
+	    if (!opts->force_dates && opts->fromtime >= display_date(c, 0, false))
+		continue;
+	    op = build_fileops(c);
+	    for (op2 = operations; op2 < op; op2++)
+		if (op2->op == 'M')
+		    op2->rev->wanted = true;
+	}
+    }
+}
+
+#ifdef GITPACK
+static const unsigned char *
+blob_name(const cvs_commit *c)
+{
+    return marksha[markmap[c->serial]];
+}
+
+static size_t
+append_text(char **buf, size_t *size, size_t used,
+	    const char *text, const size_t len)
+{
+    if (used + len > *size) {
+	*size = 2 * *size + len;
+	*buf = xrealloc(*buf, *size, "commit object");
+    }
+    memcpy(*buf + used, text, len);
+    return used + len;
+}
+
+static void
+pack_commit(const git_commit *commit, const char *ident,
+	    const char *pairs, const size_t pairslen, const serial_t here)
+/* write the object for a commit whose blobs are already in the pack */
+{
+    static char *buf;
+    static size_t size;
+    char hex[SHA1_HEXSZ + 1], line[SHA1_HEXSZ + 16];
+    unsigned char tree[SHA1_RAWSZ];
+    size_t used;
+    struct iovec iov;
+
+    revdir_tree(&commit->revdir, blob_name, tree);
+    used = append_text(&buf, &size, 0, line,
+		       sprintf(line, "tree %s\n", sha1_to_hex(tree, hex)));
+    if (commit->parent)
+	used = append_text(&buf, &size, used, line,
+			   sprintf(line, "parent %s\n",
+				   sha1_to_hex(marksha[markmap[commit->parent->serial]], hex)));
+    /* fast-import makes the committer the author when none is given */
+    used = append_text(&buf, &size, used, "author ", 7);
+    used = append_text(&buf, &size, used, ident, strlen(ident));
+    used = append_text(&buf, &size, used, "\ncommitter ", 11);
+    used = append_text(&buf, &size, used, ident, strlen(ident));
+    used = append_text(&buf, &size, used, "\n\n", 2);
+    used = append_text(&buf, &size, used, commit->log, strlen(commit->log));
+    if (pairs != NULL) {
+	used = append_text(&buf, &size, used, "\n", 1);
+	used = append_text(&buf, &size, used, pairs, pairslen);
     }
+    iov.iov_base = buf;
+    iov.iov_len = used;
+    pack_object(PACK_COMMIT, &iov, 1, used, marksha[here]);
+}
+#endif /* GITPACK */
+
+static void
+export_ref(const char *prefix, const char *name, const serial_t target,
+	   const export_options_t *opts)
+/* point a branch or tag at the commit with mark TARGET */
+{
+#ifdef GITPACK
+    if (opts->packdir != NULL) {
+	/* named as out_str() names them in the stream */
+	pack_ref(prefix, name != NULL ? name : "(null)", marksha[target]);
+	return;
+    }
+#endif /* GITPACK */
+    out_str("reset ");
+    out_str(prefix);
+    out_str(name);
+    out_str("\nfrom :");
+    out_number(target, 10);
+    out_str("\n\n");
+}
+
+/*
+ * Tags are found by the commit they point at through an index sorted
+ * by commit, so that exporting a commit does not mean scanning every
+ * tag.  Tags on the same commit keep their all_tags order.
+ */
+struct tagslot {
+    uintptr_t	commit;
+    size_t	seq;
+    const tag_t	*tag;
+};
+static struct tagslot *tagindex;
+static size_t ntagged;
+
+static int compare_tagslot(const void *ap, const void *bp)
+{
+    const struct tagslot *a = ap, *b = bp;
+
+    if (a->commit != b->commit)
+	return a->commit < b->commit ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static void index_tags(void)
+{
+    tag_t *t;
+
+    ntagged = 0;
+    tagindex = xmalloc(sizeof(struct tagslot) * (tag_count + 1), "tag index");
+    for (t = all_tags; t; t = t->next)
+	if (t->commit != NULL) {
+	    tagindex[ntagged].commit = (uintptr_t)t->commit;
+	    tagindex[ntagged].seq = ntagged;
+	    tagindex[ntagged].tag = t;
+	    ntagged++;
+	}
+    qsort(tagindex, ntagged, sizeof(struct tagslot), compare_tagslot);
+}
+
+static void export_tags(const git_commit *commit, const export_options_t *opts)
+/* point every tag on COMMIT at it */
+{
+    const uintptr_t key = (uintptr_t)commit;
+    size_t lo = 0, hi = ntagged;
+
+    /* the first slot not before COMMIT */
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (tagindex[mid].commit < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == ntagged || tagindex[lo].commit != key
+	    || display_date(commit, markmap[commit->serial], opts->force_dates) <= opts->fromtime)
+	return;
+    for (; lo < ntagged && tagindex[lo].commit == key; lo++)
+	export_ref(opts->tag_prefix, tagindex[lo].tag->name,
+		   markmap[commit->serial], opts);
+}
+
+static void
+export_commit(git_commit *commit, const char *branch,
+	      bool report, const bool from_branch,
+	      const export_options_t *opts)
+/*
+ * Export a commit and the blobs it is the first to reference.
+ * FROM_BRANCH says the parent was shipped by an earlier incremental
+ * dump, so the commit has to be attached to the existing branch tip.
+ */
+{
+    cvs_author *author;
+    const char *full;
+    const char *email;
+    const bool pairs = opts->reposurgeon || opts->revision_map || opts->embed_ids;
+    time_t ct;
+    struct fileop *op, *op2;
+    serial_t here, oldmark = 0;
+    unsigned char key[SHA1_RAWSZ];
+    bool stream;
+    static const char *s_gitignore;
+
+    if (!s_gitignore) s_gitignore = atom(".gitignore");
+
+    if (pairs && revpairs == NULL)
+	revpairs = xmalloc((revpairsize = 1024), "revpair allocation");
+    if (pairs)
+	revpairs[revpairslen = 0] = '\0';
+
+    op = build_fileops(commit);
+    if (commitkey != NULL) {
+	commit_key(commit, op, key);
+	/* the importer has it from an earlier run, and its blobs */
+	if ((oldmark = known_mark(key)) != 0)
+	    report = false;
+    }
+    /* a pack takes objects, not stream text */
+    stream = report && opts->packdir == NULL;
+    for (op2 = operations; op2 < op; op2++)
+	if (op2->op == 'M')
+	    append_revpair(op2->rev, opts);
 
     for (op2 = operations; op2 < op; op2++) {
 	if (op2->op == 'M' && !op2->rev->emitted) {
-	    if (opts->reportmode == canonical)
-		markmap[op2->rev->serial] = ++mark;
-	    if (report && opts->reportmode == canonical) {
-		char path[PATH_MAX];
-		char *fn = blobfile(op2->path, op2->rev->serial, false, path);
-		FILE *rfp = fopen(fn, "r");
-		if (rfp) {
-		    char buf[BUFSIZ];
-		    printf("blob\nmark :%d\n", (int)mark);
-
-		    while (!feof(rfp)) {
-			size_t len = fread(buf, 1, sizeof(buf), rfp);
-			(void)fwrite(buf, 1, len, stdout);
-		    }
-		    (void) unlink(fn);
-		    op2->rev->emitted = true;
-		    (void)fclose(rfp);
+	    if (opts->reportmode == canonical) {
+		++mark;
+		/* snapshots an incremental dump skips have no serial */
+		if (op2->rev->serial != 0) {
+		    markmap[op2->rev->serial] = mark;
+		    note_blob(op2->rev);
 		}
 	    }
+	    /* only generated snapshots have a serial */
+	    if (report && opts->reportmode == canonical
+		    && op2->rev->serial != 0) {
+		if (opts->blobcache > 0)
+		    ship_cached(op2->rev, mark, opts);
+		else
+		    ship_spooled(&spoolmap[op2->rev->serial], mark);
+		op2->rev->emitted = true;
+	    }
 	}
     }
 
@@ -415,38 +1353,86 @@ export_commit(git_commit *commit, const char *branch,
     if (!author) {
 	full = commit->author;
 	email = commit->author;
-	timezone = "UTC";
     } else {
 	full = author->full;
 	email = author->email;
-	timezone = author->timezone ? author->timezone : "UTC";
     }
 
-    if (report)
-	printf("commit %s%s\n", opts->branch_prefix, branch);
+    if (stream) {
+	out_str("commit ");
+	out_str(opts->branch_prefix);
+	out_str(branch);
+	out_char('\n');
+    }
     commit->serial = ++seqno;
-    here = markmap[commit->serial] = ++mark;
+    here = markmap[commit->serial] = oldmark != 0 ? oldmark : ++mark;
+    if (commitkey != NULL) {
+	memcpy(commitkey[commit->serial], key, SHA1_RAWSZ);
+	if (markfile != NULL) {
+	    char hex[SHA1_HEXSZ + 1];
+	    fprintf(markfile, "C %lu %s\n", (unsigned long)here,
+		    sha1_to_hex(key, hex));
+	}
+    }
 #ifdef ORDERDEBUG2
     /* can't move before mark is updated */
     dump_commit(commit, stderr);
 #endif /* ORDERDEBUG2 */
-    if (report)
-	printf("mark :%d\n", (int)mark);
+    if (stream) {
+	out_str("mark :");
+	out_number(mark, 10);
+	out_char('\n');
+    }
     if (report) {
 	const char *ts;
 	ct = display_date(commit, mark, opts->force_dates);
-	ts = utc_offset_timestamp(&ct, timezone);
+	ts = utc_offset_timestamp(&ct, author);
+#ifdef GITPACK
+	if (!stream) {
+	    char *ident;
+	    if (commit->parent && markmap[commit->parent->serial] == 0)
+		fatal_error("child commit emitted before parent exists");
+	    ident = xmalloc(strlen(full) + strlen(email) + strlen(ts) + 5, "ident");
+	    sprintf(ident, "%s <%s> %s", full, email, ts);
+	    pack_commit(commit, ident, opts->embed_ids ? revpairs : NULL,
+			revpairslen, here);
+	    free(ident);
+	    goto revmap;
+	}
+#endif /* GITPACK */
 	//printf("author %s <%s> %s\n", full, email, ts);
-	printf("committer %s <%s> %s\n", full, email, ts);
-	if (!opts->embed_ids)
-	    printf("data %zd\n%s\n", strlen(commit->log), commit->log);
-	else
-	    printf("data %zd\n%s\n%s\n", strlen(commit->log) + strlen(revpairs) + 1,
-		commit->log, revpairs);
-	if (commit->parent) {
-	    if (markmap[commit->parent->serial] > 0) 
-		printf("from :%d\n", (int)markmap[commit->parent->serial]);
-	    else
+	out_str("committer ");
+	out_str(full);
+	out_str(" <");
+	out_str(email);
+	out_str("> ");
+	out_str(ts);
+	out_str("\ndata ");
+	if (!opts->embed_ids) {
+	    size_t loglen = strlen(commit->log);
+	    out_number(loglen, 10);
+	    out_char('\n');
+	    out_bytes(commit->log, loglen);
+	} else {
+	    size_t loglen = strlen(commit->log);
+	    out_number(loglen + revpairslen + 1, 10);
+	    out_char('\n');
+	    out_bytes(commit->log, loglen);
+	    out_char('\n');
+	    out_bytes(revpairs, revpairslen);
+	}
+	out_char('\n');
+	if (from_branch) {
+	    out_str("from ");
+	    out_str(opts->branch_prefix);
+	    out_str(branch);
+	    out_str("^0\n");
+	} else if (commit->parent) {
+	    if (markmap[commit->parent->serial] > 0) {
+		out_str("from :");
+		out_number(markmap[commit->parent->serial], 10);
+		out_char('\n');
+	    } else
 	    {
 		cleanup(opts);
 		fatal_error("child commit emitted before parent exists");
@@ -456,15 +1442,21 @@ export_commit(git_commit *commit, const char *branch,
 	for (op2 = operations; op2 < op; op2++)
 	{
 	    assert(op2->op == 'M' || op2->op == 'D');
-	    if (op2->op == 'M')
-		printf("M 100%o :%d %s\n", 
-		       op2->mode, 
-		       (int)markmap[op2->rev->serial], 
-		       op2->path);
-	    if (op2->op == 'D')
-		printf("D %s\n", op2->path);
-	}
-	if (revpairs != NULL && strlen(revpairs) > 0)
+	    if (op2->op == 'M') {
+		out_str("M 100");
+		out_number(op2->mode, 8);
+		out_str(" :");
+		out_number(markmap[op2->rev->serial], 10);
+		out_char(' ');
+	    } else
+		out_str("D ");
+	    out_str(op2->path);
+	    out_char('\n');
+	}
+#ifdef GITPACK
+    revmap:
+#endif /* GITPACK */
+	if (pairs && revpairslen > 0)
 	{
 	    if (opts->revision_map) {
 		char *cp;
@@ -476,17 +1468,18 @@ export_commit(git_commit *commit, const char *branch,
 	    }
 	    if (opts->reposurgeon)
 	    {
-		if (report)
-		    printf("property cvs-revisions %zd %s", strlen(revpairs), revpairs);
+		if (stream) {
+		    out_str("property cvs-revisions ");
+		    out_number(revpairslen, 10);
+		    out_char(' ');
+		    out_bytes(revpairs, revpairslen);
+		}
 	    }
 	}
     }
-    free(revpairs);
-    free(operations);
 
-    if (report)
-	printf("\n");
-#undef OP_CHUNK
+    if (stream)
+	out_char('\n');
 }
 
 static int export_ncommit(const git_repo *rl)
@@ -512,27 +1505,16 @@ static int export_ncommit(const git_repo *rl)
 struct commit_seq {
     git_commit *commit;
     rev_ref *head;
-    bool realized;
 };
 
 static int compare_commit(const git_commit *ac, const git_commit *bc)
-/* attempt the mathematically impossible total ordering on the DAG */
+/* order commits by date, with arbitrary but repeatable tiebreakers */
 {
-    time_t timediff;
     int cmp;
-    
-    timediff = ac->date - bc->date;
-    if (timediff != 0)
-	return timediff;
-    timediff = ac->date - bc->date;
-    if (timediff != 0)
-	return timediff;
-    if (bc == ac->parent || (ac->parent != NULL && bc == ac->parent->parent))
-	return 1;
-    if (ac == bc->parent || (bc->parent != NULL && ac == bc->parent->parent))
-	return -1;
-
-    /* 
+
+    if (ac->date != bc->date)
+	return ac->date < bc->date ? -1 : 1;
+    /*
      * Any remaining tiebreakers would be essentially arbitrary,
      * inserted just to have as few cases where the threaded scheduler
      * is random as posssible.
@@ -540,34 +1522,133 @@ static int compare_commit(const git_commit *ac, const git_commit *bc)
     cmp = strcmp(ac->author, bc->author);
     if (cmp != 0)
 	return cmp;
-    cmp = strcmp(ac->log, bc->log);
-    if (cmp != 0)
-	return cmp;
-    
-    return 0;
+    return strcmp(ac->log, bc->log);
 }
 
-static int sort_by_date(const void *ap, const void *bp)
-/* return > 0 if ap newer than bp, < 0 if bp newer than ap */
+static bool ship_before(const struct commit_seq *history, const int a, const int b)
+/* should history[A] ship before history[B] when both are ready? */
 {
-    git_commit *ac = ((struct commit_seq *)ap)->commit;
-    git_commit *bc = ((struct commit_seq *)bp)->commit;
+    int cmp = compare_commit(history[a].commit, history[b].commit);
 
-    /* older parents drag tied commits back in time (in effect) */ 
+    /* canonicalize() order settles the rest */
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void ready_sink(const struct commit_seq *history,
+		       int *heap, const int nheap, int slot, const int entry)
+/* fill the hole at SLOT of the ready heap with ENTRY, moving it down */
+{
     for (;;) {
-	int cmp;
-	if (ac == bc)
-	    return 0;
-	cmp = compare_commit(ac, bc);
-	if (cmp != 0)
-	    return cmp;
-	if (ac->parent != NULL && bc->parent != NULL) {
-	    ac = ac->parent;
-	    bc = bc->parent;
-	    continue;
+	int c = 2 * slot + 1;
+	if (c >= nheap)
+	    break;
+	if (c + 1 < nheap && ship_before(history, heap[c + 1], heap[c]))
+	    c++;
+	if (!ship_before(history, heap[c], entry))
+	    break;
+	heap[slot] = heap[c];
+	slot = c;
+    }
+    heap[slot] = entry;
+}
+
+struct commit_slot {
+    uintptr_t	commit;
+    int		index;
+};
+
+static int commit_slot_compare(const void *ap, const void *bp)
+{
+    uintptr_t a = ((const struct commit_slot *)ap)->commit;
+    uintptr_t b = ((const struct commit_slot *)bp)->commit;
+
+    return (a > b) - (a < b);
+}
+
+static void order_history(struct commit_seq *history, const int ncommits)
+/*
+ * Sort history topologically, oldest first where the DAG leaves a
+ * choice.  This is Kahn's algorithm: a commit becomes ready when its
+ * parent has shipped, and the ready commits wait in a heap ordered
+ * by ship_before(), so a parent younger than its child only delays
+ * that child instead of breaking the order.
+ */
+{
+    struct commit_seq *sorted;
+    struct commit_slot *slots;
+    int *child, *sibling, *heap;
+    int i, nheap = 0, n = 0;
+
+    /* a commit's first child, and the next child of the same parent */
+    child = xmalloc(ncommits * sizeof(int), "export");
+    sibling = xmalloc(ncommits * sizeof(int), "export");
+    heap = xmalloc(ncommits * sizeof(int), "export");
+    for (i = 0; i < ncommits; i++)
+	child[i] = -1;
+
+    /* only branch roots have parents outside their own span */
+    slots = xmalloc(ncommits * sizeof(struct commit_slot), "export");
+    for (i = 0; i < ncommits; i++) {
+	slots[i].commit = (uintptr_t)history[i].commit;
+	slots[i].index = i;
+    }
+    qsort(slots, ncommits, sizeof(struct commit_slot), commit_slot_compare);
+
+    for (i = 0; i < ncommits; i++) {
+	const git_commit *parent = history[i].commit->parent;
+	int p = -1;
+
+	if (parent != NULL) {
+	    if (i > 0 && history[i - 1].commit == parent)
+		p = i - 1;
+	    else {
+		struct commit_slot key, *found;
+		key.commit = (uintptr_t)parent;
+		found = bsearch(&key, slots, ncommits,
+				sizeof(struct commit_slot), commit_slot_compare);
+		if (found != NULL)
+		    p = found->index;
+	    }
+	}
+	if (p >= 0) {
+	    sibling[i] = child[p];
+	    child[p] = i;
+	} else
+	    /* nothing to wait for; export_commit() catches a lost parent */
+	    heap[nheap++] = i;
+    }
+    free(slots);
+
+    /* the roots went in unordered, so heapify them */
+    for (i = nheap / 2 - 1; i >= 0; i--)
+	ready_sink(history, heap, nheap, i, heap[i]);
+
+    sorted = xmalloc(ncommits * sizeof(struct commit_seq), "export");
+    while (nheap > 0) {
+	int next = heap[0], k;
+
+	sorted[n++] = history[next];
+	/* the last entry fills the hole at the top and sinks */
+	if (--nheap > 0)
+	    ready_sink(history, heap, nheap, 0, heap[nheap]);
+	/* children of the commit just shipped are ready; let them rise */
+	for (k = child[next]; k >= 0; k = sibling[k]) {
+	    int slot = nheap++;
+	    while (slot > 0 && ship_before(history, k, heap[(slot - 1) / 2])) {
+		heap[slot] = heap[(slot - 1) / 2];
+		slot = (slot - 1) / 2;
+	    }
+	    heap[slot] = k;
 	}
-	return 0;
     }
+    /* every commit has one parent, so the DAG has no cycles to strand any */
+    assert(n == ncommits);
+
+    memcpy(history, sorted, ncommits * sizeof(struct commit_seq));
+    free(sorted);
+    free(heap);
+    free(sibling);
+    free(child);
 }
 
 static struct commit_seq *canonicalize(git_repo *rl)
@@ -629,50 +1710,110 @@ static struct commit_seq *canonicalize(git_repo *rl)
     return history;
 }
 
+/*
+ * Authors are listed in the order of their first commit in canonicalize()
+ * order, that is branch by branch and oldest first, found without
+ * building that array: a branch is walked from its tip, so the position
+ * of each author's first commit on it keeps moving back.  A hash set
+ * keyed by the author atom holds what has been seen.
+ */
+struct author_seen {
+    const char	*author;	/* NULL if the slot is free */
+    int		branch;
+    int		position;
+};
+
+static struct author_seen *seen_slot(struct author_seen *table,
+				     const size_t mask, const char *author)
+/* the slot holding AUTHOR, or the free one where it belongs */
+{
+    size_t i = ((uintptr_t)author >> 3) * 2654435761U;
+
+    for (i &= mask; table[i].author != NULL; i = (i + 1) & mask)
+	if (table[i].author == author)
+	    break;
+    return table + i;
+}
+
+static int compare_seen(const void *ap, const void *bp)
+{
+    const struct author_seen *a = ap, *b = bp;
+
+    if (a->branch != b->branch)
+	return a->branch - b->branch;
+    return a->position - b->position;
+}
+
 void export_authors(forest_t *forest, export_options_t *opts)
 /* dump a list of author IDs in the repository */
 {
-    const char **authors;
-    int i, nauthors = 0;
-    size_t alloc;
-    authors = NULL;
-    alloc = 0;
-    export_stats.export_total_commits = export_ncommit(forest->git);
-    struct commit_seq *hp, *history = canonicalize(forest->git);
+    struct author_seen *seen, *slot;
+    size_t mask = 1023, nseen = 0, i, j;
+    int branch = 0;
+    rev_ref *h;
+    git_commit *c;
 
+    seen = xcalloc(mask + 1, sizeof(struct author_seen), "author list");
     progress_begin("Finding authors...", NO_MAX);
-    for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
-	for (i = 0; i < nauthors; i++) {
-	    if (authors[i] == hp->commit->author)
-		goto duplicate;
-	}
-	if (nauthors >= alloc) {
-	    alloc += 1024;
-	    authors = xrealloc(authors, sizeof(char*) * alloc, "author list");
+    for (h = forest->git->heads; h; h = h->next) {
+	int position = 0;
+
+	if (h->tail)
+	    continue;
+	/* PUNNING: see the big comment in cvs.h */ 
+	for (c = (git_commit *)h->commit; c; c = (c->tail ? NULL : c->parent))
+	    position++;
+	for (c = (git_commit *)h->commit; c; c = (c->tail ? NULL : c->parent)) {
+	    slot = seen_slot(seen, mask, c->author);
+	    --position;
+	    if (slot->author != NULL) {
+		if (slot->branch == branch)
+		    slot->position = position;
+		continue;
+	    }
+	    slot->author = c->author;
+	    slot->branch = branch;
+	    slot->position = position;
+	    if (++nseen * 2 > mask) {
+		struct author_seen *old = seen;
+		size_t oldmask = mask;
+
+		mask = mask * 2 + 1;
+		seen = xcalloc(mask + 1, sizeof(struct author_seen),
+			       "author list");
+		for (i = 0; i <= oldmask; i++)
+		    if (old[i].author != NULL)
+			*seen_slot(seen, mask, old[i].author) = old[i];
+		free(old);
+	    }
 	}
-	authors[nauthors++] = hp->commit->author;
-    duplicate:;
+	branch++;
     }
     progress_end("done");
 
-    for (i = 0; i < nauthors; i++)
-	printf("%s\n", authors[i]);
+    for (i = j = 0; i <= mask; i++)
+	if (seen[i].author != NULL)
+	    seen[j++] = seen[i];
+    qsort(seen, nseen, sizeof(struct author_seen), compare_seen);
+    for (i = 0; i < nseen; i++)
+	printf("%s\n", seen[i].author);
 
-    free(authors);
-    free(history);
+    free(seen);
 }
 
-void export_commits(forest_t *forest, 
-		    export_options_t *opts, export_stats_t *stats)
-/* export a revision list as a git fast-import stream */
+static bool begun;		/* export_begin() has run */
+static bool generated;		/* every snapshot is shipped or spooled */
+
+static void export_begin(forest_t *forest, export_options_t *opts)
+/* settle the report mode and get ready to take snapshots */
 {
-    rev_ref *h;
-    tag_t *t;
-    git_commit *c;
-    git_repo *rl = forest->git;
-    generator_t *gp;
-    int recount = 0;
+    if (begun)
+	return;
+    begun = true;
 
+    /* a pack has no order to keep, so blobs go in as they are made */
+    if (opts->packdir != NULL)
+	opts->reportmode = fast;
     if (opts->reportmode == adaptive) {
 	if (forest->textsize <= SMALL_REPOSITORY)
 	    opts->reportmode = canonical;
@@ -680,36 +1821,210 @@ void export_commits(forest_t *forest,
 	    opts->reportmode = fast;
     }
 
+    if (opts->reportmode != canonical)
+	opts->blobcache = 0;
+
     if (opts->reportmode == canonical)
     {
-	char *tmp = getenv("TMPDIR");
-	if (tmp == NULL) 
-	    tmp = "/tmp";
 	seqno = mark = 0;
-	snprintf(blobdir, sizeof(blobdir), "%s/cvs-fast-export-XXXXXX", tmp);
-	if (mkdtemp(blobdir) == NULL)
-	    fatal_error("temp dir creation failed\n");
+	if (opts->blobcache == 0)
+	    open_spool();
     }
 
-    /* an attempt to optimize output throughput */
-    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+    if (opts->checkpoint != NULL)
+	checkpoint_load(opts);
+    out_begin();
 
-    export_stats.export_total_commits = export_ncommit(rl);
-    /* the +1 is because mark indices are 1-origin, slot 0 always empty */
+    /* room for the commits is added once collation has counted them */
     markmap = (serial_t *)xcalloc(sizeof(serial_t),
-				  forest->total_revisions + export_stats.export_total_commits + 1,
+				  forest->total_revisions + 1,
 				  "markmap allocation");
+    if (opts->blobcache > 0) {
+	cachemap = xcalloc(sizeof(struct cached *),
+			   forest->total_revisions + 1, "blob cache index");
+	genmap = xmalloc(sizeof(int) * (forest->total_revisions + 1),
+			 "blob cache index");
+	unshipped = xcalloc(sizeof(serial_t), forest->filecount,
+			    "blob cache index");
+    } else if (opts->reportmode == canonical)
+	spoolmap = xcalloc(sizeof(struct spooled),
+			   forest->total_revisions + 1, "spool index");
+#ifdef GITPACK
+    if (opts->packdir != NULL) {
+	marksha = xmalloc(SHA1_RAWSZ * (forest->total_revisions + 1), "pack names");
+	pack_begin(opts->packdir);
+    }
+#endif /* GITPACK */
+
+    generators = forest->generators;
+    ngenerators = forest->filecount;
 
-    /* export_blob() touches markmap when in fast mode */
-    progress_begin("Generating snapshots...", forest->filecount);
-    for (gp = forest->generators; 
-	 gp < forest->generators + forest->filecount;
-	 gp++) {
-	generate_files(gp, opts, export_blob);
-	generator_free(gp);
-	progress_jump(++recount);
+    if (opts->export_marks != NULL) {
+	/* the imported file stays whole until this one is complete */
+	snprintf(markfile_tmp, sizeof(markfile_tmp), "%s.tmp", opts->export_marks);
+	if ((markfile = fopen(markfile_tmp, "w")) == NULL)
+	    fatal_system_error("cannot write marks file %s", markfile_tmp);
     }
-    progress_end("done");
+    if (opts->import_marks != NULL) {
+	generator_t *gp;
+	int recount = 0;
+
+	import_marks(opts);
+	/* only what the importer lacks is generated */
+	partial = true;
+	progress_begin("Matching imported marks...", forest->filecount);
+	for (gp = generators; gp < generators + ngenerators; gp++) {
+	    generate_revisions(gp, claim_revision);
+	    progress_jump(++recount);
+	}
+	progress_end("done");
+    }
+}
+
+static void generate_snapshots(forest_t *forest, export_options_t *opts)
+/* make every snapshot, or in blob cache mode just number them */
+{
+    generator_t *gp;
+    int recount = 0;
+
+    if (opts->blobcache > 0) {
+	/* snapshots are made as they are shipped; only number them now */
+	partial = opts->fromtime > 0 || opts->import_marks != NULL;
+	progress_begin("Counting snapshots...", forest->filecount);
+	for (gp = forest->generators;
+	     gp < forest->generators + forest->filecount;
+	     gp++) {
+	    counting = gp;
+	    generate_revisions(gp, count_revision);
+	    if (unshipped[gp - forest->generators] == 0)
+		generator_free(gp);
+	    progress_jump(++recount);
+	}
+	progress_end("done");
+    } else if (checkpointing && opts->reportmode == fast
+	       && opts->fromtime == 0
+	       && resume.blobs > 0 && resume.blobs <= resume.length) {
+	/* the importer has every blob; they need only their marks */
+	progress_begin("Numbering snapshots...", forest->filecount);
+	for (gp = forest->generators;
+	     gp < forest->generators + forest->filecount;
+	     gp++) {
+	    generate_revisions(gp, number_revision);
+	    generator_free(gp);
+	    progress_jump(++recount);
+	}
+	progress_end("done");
+	assert(outlen == 0);
+	streamed = lastcheck = resume.blobs;
+	streamhash = resume.blobhash;
+	if (streamed == resume.length)
+	    resume_check();
+	generated = true;
+	return;
+    } else {
+	/* export_blob() touches markmap when in fast mode */
+	progress_begin("Generating snapshots...", forest->filecount);
+	for (gp = forest->generators; 
+	     gp < forest->generators + forest->filecount;
+	     gp++) {
+	    generate_files(gp, opts, export_blob);
+#ifdef GITPACK
+	    if (opts->packdir != NULL)
+		pack_blob_chain_end();
+#endif /* GITPACK */
+	    generator_free(gp);
+	    progress_jump(++recount);
+	}
+	progress_end("done");
+    }
+    if (spool != NULL && (fflush(spool) != 0 || ferror(spool)))
+	fatal_system_error("write to blob spool failed");
+    if (checkpointing && opts->reportmode == fast)
+	checkpoint_save(opts, true);
+    generated = true;
+}
+
+void export_snapshots(forest_t *forest, export_options_t *opts)
+/*
+ * Ship or spool every snapshot before collation, which they do not
+ * depend on, so a fast-mode stream starts at once and the importer
+ * works on the blobs while the changesets are still being built.
+ */
+{
+    export_begin(forest, opts);
+    /* both choose what to generate by looking at the changesets */
+    if (opts->fromtime > 0 || opts->blobcache > 0)
+	return;
+    generate_snapshots(forest, opts);
+    /* let the importer have them while collation runs */
+    out_flush();
+}
+
+void export_abort(export_options_t *opts)
+/*
+ * Collation failed after export_snapshots() had started the export.
+ * The blobs already out stay there, and so does the checkpoint taken
+ * after them, but there is no "done", the pack and the marks file are
+ * never finished, and the spool is let go.
+ */
+{
+    if (!begun)
+	return;
+    out_flush();
+#ifdef GITPACK
+    if (opts->packdir != NULL) {
+	pack_abort();
+	free(marksha);
+    }
+#endif /* GITPACK */
+    if (markfile != NULL) {
+	(void)fclose(markfile);
+	(void)unlink(markfile_tmp);
+	markfile = NULL;
+    }
+    free(markmap);
+    cleanup(opts);
+}
+
+void export_commits(forest_t *forest, 
+		    export_options_t *opts, export_stats_t *stats)
+/* export a revision list as a git fast-import stream */
+{
+    rev_ref *h;
+    git_commit *c;
+    git_repo *rl = forest->git;
+    size_t nmarks;
+
+    export_begin(forest, opts);
+
+    export_stats.export_total_commits = export_ncommit(rl);
+    /* the +1 is because mark indices are 1-origin, slot 0 always empty */
+    nmarks = forest->total_revisions + export_stats.export_total_commits + 1;
+    markmap = (serial_t *)xrealloc(markmap, sizeof(serial_t) * nmarks,
+				   "markmap allocation");
+    memset(markmap + forest->total_revisions + 1, 0,
+	   sizeof(serial_t) * export_stats.export_total_commits);
+#ifdef GITPACK
+    if (opts->packdir != NULL) {
+	/* workers may still be naming blobs in place */
+	pack_wait();
+	marksha = xrealloc(marksha, SHA1_RAWSZ * nmarks, "pack names");
+    }
+#endif /* GITPACK */
+
+    if (opts->import_marks != NULL || opts->export_marks != NULL)
+	commitkey = xmalloc(SHA1_RAWSZ * nmarks, "commit keys");
+
+    if (opts->fromtime > 0)
+	mark_wanted(rl, opts);
+
+    if (!generated)
+	generate_snapshots(forest, opts);
+#ifdef GITPACK
+    /* the commits need the blob names the pack workers are computing */
+    if (opts->packdir != NULL)
+	pack_wait();
+#endif /* GITPACK */
 
     if (progress)
     {
@@ -719,8 +2034,9 @@ void export_commits(forest_t *forest,
 	progress_begin(msgbuf, export_stats.export_total_commits);
     }
 
+    index_tags();
     if (opts->reposurgeon)
-	fputs("#reposurgeon sourcetype cvs\n", stdout);
+	out_str("#reposurgeon sourcetype cvs\n");
     if (opts->reportmode == fast) {
 	/*
 	 * Dump by branch order, not by commit date.  Slightly faster
@@ -754,16 +2070,17 @@ void export_commits(forest_t *forest,
 		 */
 		for (i=n-1; i>=0; i--) {
 		    git_commit *gc = history[i];
-		    if (opts->fromtime >= gc->date)
+		    bool from_branch;
+		    if (opts->fromtime >= display_date(gc, mark+1, opts->force_dates)) {
+			/* it still takes a mark, which forced dates count */
+			export_commit(gc, h->ref_name, false, false, opts);
 			continue;
-		    if (gc->parent != NULL && display_date(gc->parent, markmap[gc->parent->serial], opts->force_dates) < opts->fromtime)
-			(void)printf("from %s%s^0\n\n",
-				     opts->branch_prefix, h->ref_name);
-		    export_commit(gc, h->ref_name, true, opts);
+		    }
+		    from_branch = gc->parent != NULL && display_date(gc->parent, markmap[gc->parent->serial], opts->force_dates) <= opts->fromtime;
+		    export_commit(gc, h->ref_name, true, from_branch, opts);
 		    progress_step();
-		    for (t = all_tags; t; t = t->next)
-			if (t->commit == gc && display_date(gc, markmap[gc->serial], opts->force_dates) > opts->fromtime)
-			    printf("reset %s%s\nfrom :%d\n\n", opts->tag_prefix, t->name, (int)markmap[gc->serial]);
+		    export_tags(gc, opts);
+		    checkpoint_maybe(opts);
 		}
 
 		free(history);
@@ -773,7 +2090,6 @@ void export_commits(forest_t *forest,
     else 
     {	
 	struct commit_seq *history, *hp;
-	bool sortable;
 
 	history = canonicalize(rl);
  
@@ -783,48 +2099,34 @@ void export_commits(forest_t *forest,
 	    dump_commit(hp->commit, stderr);
 #endif /* ORDERDEBUG2 */
 
-	/* 
-	 * Check that the topo order is consistent with time order.
-	 * If so, we can sort commits by date without worrying that
-	 * we'll try to ship a mark before it's defined.
-	 */
-	sortable = true;
+	/* harmless now, but a hint that aggregation went wrong */
 	for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
 	    if (hp->commit->parent && hp->commit->parent->date > hp->commit->date) {
-		sortable = false;
 		announce("some parent commits are younger than children.\n");
 		break;
 	    }
 	}
-	if (sortable)
-	    qsort((void *)history, 
-		  export_stats.export_total_commits, sizeof(struct commit_seq),
-		  sort_by_date);
+	order_history(history, export_stats.export_total_commits);
 
 #ifdef ORDERDEBUG2
 	fputs("Export phase 3:\n", stderr);
 #endif /* ORDERDEBUG2 */
 	for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
-	    bool report = true;
+	    bool report = true, from_branch = false;
 	    if (opts->fromtime > 0) {
 		if (opts->fromtime >= display_date(hp->commit, mark+1, opts->force_dates)) {
 		    report = false;
-		} else if (!hp->realized) {
-		    struct commit_seq *lp;
-		    if (hp->commit->parent != NULL && display_date(hp->commit->parent, markmap[hp->commit->parent->serial], opts->force_dates) < opts->fromtime)
-			(void)printf("from %s%s^0\n\n", opts->branch_prefix, hp->head->ref_name);
-		    for (lp = hp; lp < history + export_stats.export_total_commits; lp++) {
-			if (lp->head == hp->head) {
-			    lp->realized = true;
-			}
-		    }
+		} else if (!hp->head->realized) {
+		    /* the first commit shipped on a branch attaches it */
+		    if (hp->commit->parent != NULL && display_date(hp->commit->parent, markmap[hp->commit->parent->serial], opts->force_dates) <= opts->fromtime)
+			from_branch = true;
+		    hp->head->realized = true;
 		}
 	    }
 	    progress_jump(hp - history);
-	    export_commit(hp->commit, hp->head->ref_name, report, opts);
-	    for (t = all_tags; t; t = t->next)
-		if (t->commit == hp->commit && display_date(hp->commit, markmap[hp->commit->serial], opts->force_dates) > opts->fromtime)
-		    printf("reset %s%s\nfrom :%d\n\n", opts->tag_prefix, t->name, (int)markmap[hp->commit->serial]);
+	    export_commit(hp->commit, hp->head->ref_name, report, from_branch, opts);
+	    export_tags(hp->commit, opts);
+	    checkpoint_maybe(opts);
 	}
 
 	free(history);
@@ -832,20 +2134,45 @@ void export_commits(forest_t *forest,
 
     for (h = rl->heads; h; h = h->next) {
 	if (display_date(h->commit, markmap[h->commit->serial], opts->force_dates) > opts->fromtime)
-	    printf("reset %s%s\nfrom :%d\n\n",
-		   opts->branch_prefix,
-		   h->ref_name,
-		   (int)markmap[h->commit->serial]);
+	    export_ref(opts->branch_prefix, h->ref_name,
+		       markmap[h->commit->serial], opts);
     }
+    if (markfile != NULL) {
+	if (fflush(markfile) != 0 || ferror(markfile) || fclose(markfile) != 0
+	    || rename(markfile_tmp, opts->export_marks) != 0)
+	    fatal_system_error("cannot write marks file %s", opts->export_marks);
+	markfile = NULL;
+    }
+    free(commitkey);
+    commitkey = NULL;
+    free(known);
+    known = NULL;
     free(markmap);
+    free(tagindex);
+    tagindex = NULL;
+    free(operations);
+    operations = NULL;
+    free(revpairs);
+    revpairs = NULL;
 
     progress_end("done");
 
+    if (checkpointing)
+	checkpoint_save(opts, false);
+#ifdef GITPACK
+    if (opts->packdir != NULL) {
+	pack_end();
+	free(marksha);
+    } else
+#endif /* GITPACK */
 	if (!opts->reposurgeon) {
-		fputs("done\n", stdout);
+		out_str("done\n");
 	}
 
+    out_flush();
     cleanup(opts);
+    if (checkpointing && streamed < resume.length)
+	fatal_error("stream is shorter than the checkpointed conversion");
 
     if (forest->skew_vulnerable > 0 && forest->filecount > 1 && !opts->force_dates) {
 	time_t udate = forest->skew_vulnerable;
@@ -20,6 +20,7 @@
  */
 
 #include <limits.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include "cvs.h"
 
@@ -118,12 +119,14 @@ static void in_buffer_init(editbuffer_t *eb,
 			   const bool bypass_initial)
 {
     Ginbuf(eb)->ptr = Ginbuf(eb)->buffer = (uchar *)text;
+    Ginbuf(eb)->limit = Ginbuf(eb)->ptr;
     Ginbuf(eb)->read_count=0;
     if (bypass_initial && *Ginbuf(eb)->ptr++ != SDELIM)
 	fatal_error("Illegal buffer, missing @ %s", text);
 }
 
 static void out_buffer_init(editbuffer_t *eb)
+/* the buffer lives as long as the generator and keeps its high-water size */
 {
     char *t;
     eb->Goutbuf = xmalloc(sizeof(struct out_buffer_type), "out_buffer_init");
@@ -134,6 +137,11 @@ static void out_buffer_init(editbuffer_t *eb)
     eb->Goutbuf->end_of_text = t + eb->Goutbuf->size;
 }
 
+static void out_buffer_reset(editbuffer_t *eb)
+{
+    eb->Goutbuf->ptr = eb->Goutbuf->text;
+}
+
 static void out_buffer_enlarge(editbuffer_t *eb)
 {
     register struct out_buffer_type *ob = eb->Goutbuf;
@@ -154,10 +162,11 @@ static char *out_buffer_text(const editbuffer_t *const eb)
     return eb->Goutbuf->text;
 }
 
-static void out_buffer_cleanup(const editbuffer_t *eb)
+static void out_buffer_cleanup(editbuffer_t *eb)
 {
     free(eb->Goutbuf->text);
     free(eb->Goutbuf);
+    eb->Goutbuf = NULL;
 }
 
 inline static void out_putc(editbuffer_t *eb, const int c)
@@ -188,16 +197,60 @@ static void out_printf(editbuffer_t *eb, const char *fmt, ...)
     }
 }
 
+static void out_awrite(editbuffer_t *eb, const char *s, size_t len)
+{
+    struct out_buffer_type *ob = eb->Goutbuf;
+    /* strictly greater, so out_putc's invariant ptr < end_of_text holds */
+    while ((size_t)(ob->end_of_text - ob->ptr) <= len)
+	out_buffer_enlarge(eb);
+    memcpy(ob->ptr, s, len);
+    ob->ptr += len;
+}
+
 static void out_fputs(editbuffer_t *eb, const char *s)
 {
-    while (*s)
-	out_putc(eb, *s++);
+    out_awrite(eb, s, strlen(s));
 }
 
-static void out_awrite(editbuffer_t *eb, const char *s, size_t len)
+/*
+ * Word-at-a-time scanning for the bytes the keyword expander has to
+ * look at: the keyword delimiter, the string delimiter (which may be
+ * the end of the text or the first half of an escaped @@) and end of
+ * line.  Everything in between is copied to output verbatim.
+ */
+#define ONES	UINT64_C(0x0101010101010101)
+#define HIGHS	UINT64_C(0x8080808080808080)
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+#define HASBYTE(w, c)	HASZERO((w) ^ (ONES * (uchar)(c)))
+
+static uchar *scan_plain(uchar *p, const uchar *lim)
+/* return the first byte at or after P that expandline must examine */
+{
+    while (lim - p >= (ptrdiff_t)sizeof(uint64_t)) {
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	if (HASBYTE(w, KDELIM) | HASBYTE(w, SDELIM) | HASBYTE(w, '\n'))
+	    break;
+	p += sizeof(w);
+    }
+    /* terminates, as every line ends in a newline or a string delimiter */
+    while (*p != KDELIM && *p != SDELIM && *p != '\n')
+	p++;
+    return p;
+}
+
+static bool in_buffer_copy_plain(editbuffer_t *eb)
+/* pass through input up to the next byte needing interpretation */
 {
-    while (len--)
-	out_putc(eb, *s++);
+    uchar *start = Ginbuf(eb)->ptr;
+    uchar *end = scan_plain(start, Ginbuf(eb)->limit);
+
+    if (end == start)
+	return false;
+    out_awrite(eb, (char *)start, end - start);
+    Ginbuf(eb)->ptr = end;
+    Ginbuf(eb)->read_count += end - start;
+    return true;
 }
 
 static bool latin1_alpha(const int c)
@@ -478,12 +531,15 @@ static void keyreplace(editbuffer_t *eb, enum markers marker)
 /* output the appropriate keyword value(s) */
 {
     char *leader = NULL;
-    char date_string[25];
+    const char *date_string;
     enum expand_mode exp = eb->Gexpand;
     char const *kw = Keyword[(int)marker];
-    time_t utime = RCS_EPOCH + eb->Gversion->date;
 
-    strftime(date_string, 25, "%Y/%m/%d %H:%M:%S", localtime(&utime));
+    if (eb->Gdate_version != eb->Gversion) {
+	cvstime2rcsdate(eb->Gversion->date, eb->Gdate_string);
+	eb->Gdate_version = eb->Gversion;
+    }
+    date_string = eb->Gdate_string;
 
     out_printf(eb, "%c%s", KDELIM, kw);
 
@@ -670,6 +726,8 @@ static int expandline(editbuffer_t *eb)
     r = -1;
 
     for (;;) {
+	if (in_buffer_copy_plain(eb))
+	    r = 0;
 	c = in_buffer_getc(eb);
 	for (;;) {
 	    switch(c) {
@@ -808,7 +866,10 @@ unload_all_text(editbuffer_t *eb)
 {
     if (eb->text_map.filename) {
 	munmap(eb->text_map.base, eb->text_map.size);
+	/* a later load_text() must not unmap this range again */
 	eb->text_map.filename = NULL;
+	eb->text_map.base = NULL;
+	eb->text_map.size = 0;
     }
 }
 
@@ -896,19 +957,440 @@ static void process_delta(editbuffer_t *eb,
     }
 }
 
-static void expandedit(editbuffer_t *eb)
+/*
+ * Delta composition.
+ *
+ * Revisions that are never emitted and have no branch to enter
+ * (dead states, those outside an incremental window) still have to
+ * be passed through on the way down a delta chain.  Rather than
+ * shuffle the line array for each of them, their ed scripts are
+ * folded into a single script over the lines of the last revision
+ * actually built, and that script is applied in one pass when a
+ * revision whose text is needed comes along.
+ *
+ * The composed text is a list of pieces, each a run of either base
+ * lines or lines captured from the skipped deltas.  Like the line
+ * array itself the list has a gap at the edit point: pieces before
+ * it are kept in order, pieces after it in reverse order, so that
+ * the mostly-ascending edits of a delta only ever touch its ends.
+ */
+
+#ifdef LINESTATS
+typedef editline_t line_t;
+#else
+typedef uchar *line_t;
+#endif
+
+struct piece {
+    size_t start, count;	/* a run of base or pool lines */
+    bool pooled;		/* true if the run is in the pool */
+};
+
+struct composition {
+    bool active;
+    struct piece *front, *back;
+    size_t nfront, maxfront, nback, maxback;
+    size_t frontlines, backlines;
+    line_t *pool;		/* lines inserted by skipped deltas */
+    size_t npool, maxpool;
+};
+
+static void piece_push(struct piece **v, size_t *n, size_t *max,
+		       const struct piece p, const bool ascending)
+/* add P to a piece list, merging it with its neighbour if contiguous */
+{
+    if (*n > 0) {
+	struct piece *top = &(*v)[*n - 1];
+	if (top->pooled == p.pooled) {
+	    if (ascending && top->start + top->count == p.start) {
+		top->count += p.count;
+		return;
+	    }
+	    if (!ascending && p.start + p.count == top->start) {
+		top->start = p.start;
+		top->count += p.count;
+		return;
+	    }
+	}
+    }
+    if (*n == *max) {
+	*max = *max ? *max * 2 : 64;
+	*v = xrealloc(*v, sizeof(struct piece) * *max, "composition");
+    }
+    (*v)[(*n)++] = p;
+}
+
+static void compose_seek(struct composition *c, const size_t n)
+/* move the edit point to line N of the composed text */
+{
+    while (c->frontlines < n) {
+	struct piece p = c->back[c->nback - 1];
+	size_t want = n - c->frontlines;
+	if (p.count <= want)
+	    c->nback--;
+	else {
+	    c->back[c->nback - 1].start += want;
+	    c->back[c->nback - 1].count -= want;
+	    p.count = want;
+	}
+	piece_push(&c->front, &c->nfront, &c->maxfront, p, true);
+	c->frontlines += p.count;
+	c->backlines -= p.count;
+    }
+    while (c->frontlines > n) {
+	struct piece p = c->front[c->nfront - 1];
+	size_t give = c->frontlines - n;
+	if (p.count <= give)
+	    c->nfront--;
+	else {
+	    c->front[c->nfront - 1].count -= give;
+	    p.start += p.count - give;
+	    p.count = give;
+	}
+	piece_push(&c->back, &c->nback, &c->maxback, p, false);
+	c->frontlines -= p.count;
+	c->backlines += p.count;
+    }
+}
+
+static void compose_insert(struct composition *c, const size_t n,
+			   const line_t line)
+/* Before line N of the composed text, insert LINE.  N is 0-origin. */
 {
+    struct piece p;
+
+    if (n > c->frontlines + c->backlines)
+	fatal_error("edit script tried to insert beyond eof");
+    compose_seek(c, n);
+    if (c->npool == c->maxpool) {
+	c->maxpool = c->maxpool ? c->maxpool * 2 : 1024;
+	c->pool = xrealloc(c->pool, sizeof(line_t) * c->maxpool, "composition");
+    }
+    p.start = c->npool;
+    p.count = 1;
+    p.pooled = true;
+    c->pool[c->npool++] = line;
+    piece_push(&c->front, &c->nfront, &c->maxfront, p, true);
+    c->frontlines++;
+}
+
+static void compose_delete(struct composition *c,
+			   const size_t n, const size_t nlines)
+/* Delete composed lines N through N+NLINES-1.  N is 0-origin.  */
+{
+    size_t l = n + nlines, left = nlines;
+
+    if (c->frontlines + c->backlines < l  ||  l < n)
+	fatal_error("edit script tried to delete beyond eof");
+    compose_seek(c, n);
+    while (left > 0) {
+	struct piece *p = &c->back[c->nback - 1];
+	if (p->count <= left) {
+	    left -= p->count;
+	    c->nback--;
+	} else {
+	    p->start += left;
+	    p->count -= left;
+	    left = 0;
+	}
+    }
+    c->backlines -= nlines;
+}
+
+static void compose_delta(editbuffer_t *eb)
+/* fold the delta of the current node into the pending composition */
+{
+    struct composition *c = eb->Gcompose;
+    long adjust = 0;
+    enum edit_op editor_command;
+    struct diffcmd dc;
+    line_t line;
+    long i;
+
+    if (c == NULL)
+	c = eb->Gcompose = xcalloc(1, sizeof(struct composition), "composition");
+    if (!c->active) {
+	struct piece all = {0, Glinemax(eb) - Ggapsize(eb), false};
+	c->active = true;
+	c->nfront = c->nback = c->npool = 0;
+	c->frontlines = 0;
+	c->backlines = all.count;
+	if (all.count > 0)
+	    piece_push(&c->back, &c->nback, &c->maxback, all, false);
+    }
+
+    in_buffer_init(eb, Gnode_text(eb), true);
+    dc.dafter = dc.adprev = 0;
+    while ((editor_command = parse_next_delta_command(eb, &dc)) != eof) {
+	switch (editor_command)
+	{
+	case append:
+	    for (i = 0; i < dc.nlines; i++) {
 #ifdef LINESTATS
-    editline_t *p, *lim, *l = Gline(eb);
+		line.ptr = in_get_line(eb);
+		line.length = eb->line_len;
+		line.has_stringdelim = eb->has_stringdelim;
+		if (line.ptr == NULL)
+#else
+		line = in_get_line(eb);
+		if (line == NULL)
+#endif
+		    fatal_error("edit script ran out of text in %s",
+				eb->Gfilename);
+		compose_insert(c, dc.line1 + adjust + i, line);
+	    }
+	    adjust += dc.nlines;
+	    break;
+	case delete:
+	    compose_delete(c, dc.line1 - 1 + adjust, dc.nlines);
+	    adjust -= dc.nlines;
+	    break;
+	case replace:
+	    fatal_error("edit operation not found in %s", eb->Gfilename);
+	case eof:
+	    /* should never happen */
+	    break;
+	}
+    }
+}
 
-    for (p=l, lim=l+Ggap(eb);  p<lim;  ) {
-	in_buffer_init(eb, (*p++).ptr, false);
-	expandline(eb);
+static size_t copy_piece(editbuffer_t *eb, line_t *to, const struct piece *p)
+/* copy the lines of piece P, returning how many there were */
+{
+    struct composition *c = eb->Gcompose;
+    size_t head;
+
+    if (p->pooled) {
+	memcpy(to, c->pool + p->start, sizeof(line_t) * p->count);
+	return p->count;
     }
-    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  ) {
-	in_buffer_init(eb, (*p++).ptr, false);
-	expandline(eb);
+    /* base lines are numbered around the gap of the frame's array */
+    head = p->start < Ggap(eb) ? min(p->count, Ggap(eb) - p->start) : 0;
+    memcpy(to, Gline(eb) + p->start, sizeof(line_t) * head);
+    memcpy(to + head, Gline(eb) + Ggapsize(eb) + p->start + head,
+	   sizeof(line_t) * (p->count - head));
+    return p->count;
+}
+
+static void compose_flush(editbuffer_t *eb)
+/* apply any pending composition to the current frame */
+{
+    struct composition *c = eb->Gcompose;
+    size_t total, linemax, k = 0, i;
+    line_t *line;
+
+    if (c == NULL || !c->active)
+	return;
+    c->active = false;
+    total = c->frontlines + c->backlines;
+    linemax = max(Glinemax(eb), total);
+    line = xmalloc(sizeof(line_t) * linemax, "composition");
+    for (i = 0; i < c->nfront; i++)
+	k += copy_piece(eb, line + k, &c->front[i]);
+    for (i = c->nback; i-- > 0; )
+	k += copy_piece(eb, line + k, &c->back[i]);
+    free(Gline(eb));
+    Gline(eb) = line;
+    Glinemax(eb) = linemax;
+    Ggap(eb) = total;
+    Ggapsize(eb) = linemax - total;
+}
+
+static void compose_discard(editbuffer_t *eb)
+/* forget edits whose result turned out not to be needed */
+{
+    if (eb->Gcompose != NULL)
+	eb->Gcompose->active = false;
+}
+
+static void compose_free(editbuffer_t *eb)
+{
+    struct composition *c = eb->Gcompose;
+
+    if (c != NULL) {
+	free(c->front);
+	free(c->back);
+	free(c->pool);
+	free(c);
+	eb->Gcompose = NULL;
     }
+}
+
+static size_t count_lines(const uchar *p, const size_t len)
+/* number of lines the edit engine would split a span of text into */
+{
+    const uchar *end = p + len, *nl;
+    size_t n = 0;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+	n++;
+	p = nl + 1;
+    }
+    return n + (p < end);
+}
+
+static bool match_command(const uchar **pp, const uchar *end, const int cmd,
+			  unsigned long *line1, unsigned long *nlines)
+/* match an ed command CMD directly on the delta text */
+{
+    const uchar *p = *pp;
+    unsigned long a = 0, b = 0;
+
+    if (p >= end || *p++ != cmd || p >= end || !isdigit(*p))
+	return false;
+    while (p < end && isdigit(*p))
+	a = a * 10 + (*p++ - '0');
+    if (p >= end || *p != ' ')
+	return false;
+    while (p < end && *p == ' ')
+	p++;
+    if (p >= end || !isdigit(*p))
+	return false;
+    while (p < end && isdigit(*p))
+	b = b * 10 + (*p++ - '0');
+    if (p >= end || *p++ != '\n')
+	return false;
+    *line1 = a;
+    *nlines = b;
+    *pp = p;
+    return true;
+}
+
+static void set_whole(editbuffer_t *eb, uchar *text, const size_t len,
+		      const size_t nlines)
+/* make the current revision a single span of master text */
+{
+    struct frame *f = eb->current;
+
+    f->whole = true;
+    f->whole_text = text;
+    f->whole_len = len;
+    f->whole_lines = nlines;
+    f->whole_delim = len > 0 && memchr(text, SDELIM, len) != NULL;
+    /* the line array is stale now; keep its storage */
+    Ggap(eb) = 0;
+    Ggapsize(eb) = Glinemax(eb);
+}
+
+static size_t current_lines(editbuffer_t *eb)
+{
+    struct frame *f = eb->current;
+
+    if (!f->whole)
+	return Glinemax(eb) - Ggapsize(eb);
+    if (f->whole_lines == SIZE_MAX)
+	f->whole_lines = count_lines(f->whole_text, f->whole_len);
+    return f->whole_lines;
+}
+
+static bool whole_replacement(editbuffer_t *eb)
+/*
+ * RCS stores binary revisions as deltas that delete every line and
+ * append the entire new text: "d1 N" then "aN M", either half
+ * missing when the old or new text is empty.  Recognize those
+ * so the new text can be kept as a span, never split into lines.
+ */
+{
+    uchar *p = Gnode_text(eb) + 1;
+    const uchar *end = Gnode_text(eb) + eb->current->node->patch->text.length - 1;
+    unsigned long line1, nlines, nnew = 0;
+    size_t cur = current_lines(eb);
+
+    if (match_command((const uchar **)&p, end, 'd', &line1, &nlines)) {
+	if (line1 != 1 || nlines != cur)
+	    return false;
+	if (p < end && (!match_command((const uchar **)&p, end, 'a', &line1, &nnew)
+			|| line1 != cur || nnew == 0))
+	    return false;
+    } else if (cur != 0
+	       || !match_command((const uchar **)&p, end, 'a', &line1, &nnew)
+	       || line1 != 0 || nnew == 0)
+	return false;
+
+    /* anything after the appended text would be a further edit */
+    if (count_lines(p, end - p) != nnew)
+	return false;
+    set_whole(eb, p, end - p, nnew);
+    return true;
+}
+
+static void materialize(editbuffer_t *eb)
+/* split a whole-text revision into lines for the edit engine */
+{
+    struct frame *f = eb->current;
+    unsigned long n = 0;
+    uchar *ptr;
+
+    f->whole = false;
+    if (f->whole_len == 0)
+	return;
+    /* the span always runs up to the closing @ of its text */
+    in_buffer_init(eb, f->whole_text, false);
+    while ((ptr = in_get_line(eb)))
+	insertline(eb, n++, ptr);
+}
+
+static void enter_text(editbuffer_t *eb, const node_t *const node)
+/* set up the head revision */
+{
+    if (eb->Gexpand == EXPANDKB)
+	set_whole(eb, Gnode_text(eb) + 1, node->patch->text.length - 2,
+		  SIZE_MAX);
+    else
+	process_delta(eb, node, ENTER);
+}
+
+static void apply_delta(editbuffer_t *eb, const node_t *const node)
+/* turn the current revision into the one at NODE */
+{
+    compose_flush(eb);
+    if (eb->Gexpand == EXPANDKB && whole_replacement(eb))
+	return;
+    if (eb->current->whole)
+	materialize(eb);
+    process_delta(eb, node, EDIT);
+}
+
+static void skip_delta(editbuffer_t *eb, const node_t *const node)
+/* pass through the revision at NODE, whose text nobody will look at */
+{
+    /* binary deltas are nearly always whole replacements, cheap already */
+    if (eb->Gexpand == EXPANDKB)
+	apply_delta(eb, node);
+    else
+	compose_delta(eb);
+}
+
+#ifdef LINESTATS
+static void snapshotline(editbuffer_t *eb, register uchar * l);
+static void snapshotline_nodelim(editbuffer_t *eb, editline_t *l);
+
+static void expandline_stats(editbuffer_t *eb, editline_t *l)
+/* expand one line whose extent is known */
+{
+    /* most lines have no keywords at all and can be block-copied */
+    if (memchr(l->ptr, KDELIM, l->length) == NULL) {
+	if (l->has_stringdelim)
+	    snapshotline(eb, l->ptr);
+	else
+	    snapshotline_nodelim(eb, l);
+	return;
+    }
+    in_buffer_init(eb, l->ptr, false);
+    Ginbuf(eb)->limit = l->ptr + l->length;
+    expandline(eb);
+}
+#endif
+
+static void expandedit(editbuffer_t *eb)
+{
+#ifdef LINESTATS
+    editline_t *p, *lim, *l = Gline(eb);
+
+    for (p=l, lim=l+Ggap(eb);  p<lim;  p++)
+	expandline_stats(eb, p);
+    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  p++)
+	expandline_stats(eb, p);
 #else
     uchar **p, **lim, **l = Gline(eb);
 
@@ -1019,23 +1501,186 @@ static void snapshotedit(editbuffer_t *eb)
 }
 #endif
 
-static void enter_branch(editbuffer_t *eb, const node_t *const node)
+static void note_origin(editbuffer_t *eb,
+			const uchar *source, const size_t length)
+/* record where the next line of the snapshot came from */
+{
+    if (eb->Gorigincount == eb->Goriginmax) {
+	eb->Goriginmax = eb->Goriginmax ? eb->Goriginmax * 2 : 256;
+	eb->Gorigin = xrealloc(eb->Gorigin,
+			       sizeof(line_origin_t) * eb->Goriginmax, __func__);
+    }
+    eb->Gorigin[eb->Gorigincount].source = source;
+    eb->Gorigin[eb->Gorigincount].length = length;
+    eb->Gorigincount++;
+}
+
+static void origin_line(editbuffer_t *eb, line_t *p)
+/* put one line into the snapshot and note its origin */
 {
+    const unsigned long before = out_buffer_count(eb);
+
 #ifdef LINESTATS
-    editline_t *p = xmalloc(sizeof(editline_t) * eb->current->linemax, "enter branch");
-    memcpy(p, eb->current->line, sizeof(editline_t) * eb->current->linemax);
+    if (eb->Gexpand < EXPANDKO)
+	expandline_stats(eb, p);
+    else if (p->has_stringdelim)
+	snapshotline(eb, p->ptr);
+    else
+	snapshotline_nodelim(eb, p);
+    note_origin(eb, p->ptr, out_buffer_count(eb) - before);
+#else
+    if (eb->Gexpand < EXPANDKO) {
+	in_buffer_init(eb, *p, false);
+	expandline(eb);
+    } else
+	snapshotline(eb, *p);
+    note_origin(eb, *p, out_buffer_count(eb) - before);
+#endif
+}
+
+static void originedit(editbuffer_t *eb)
+/* expandedit() or snapshotedit(), keeping the origin of each line */
+{
+    line_t *p, *lim, *l = Gline(eb);
+
+    for (p=l, lim=l+Ggap(eb);  p<lim;  p++)
+	origin_line(eb, p);
+    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  p++)
+	origin_line(eb, p);
+}
+
+#ifdef LINESTATS
+static void span_append(editbuffer_t *eb, uchar *ptr, size_t length)
+/* add bytes to the span list, extending the last span when contiguous */
+{
+    struct iovec *last = eb->Gspan + eb->Gspancount - 1;
+
+    if (eb->Gspancount > 0 && (uchar *)last->iov_base + last->iov_len == ptr) {
+	last->iov_len += length;
+	return;
+    }
+    if (eb->Gspancount == eb->Gspanmax) {
+	eb->Gspanmax = eb->Gspanmax ? eb->Gspanmax * 2 : 64;
+	eb->Gspan = xrealloc(eb->Gspan,
+			     sizeof(struct iovec) * eb->Gspanmax, __func__);
+    }
+    eb->Gspan[eb->Gspancount].iov_base = ptr;
+    eb->Gspan[eb->Gspancount].iov_len = length;
+    eb->Gspancount++;
+}
+
+static bool spanedit(editbuffer_t *eb, size_t *len)
+/*
+ * Describe an unexpanded snapshot as spans of the master text.  This
+ * is only possible when no line contains an escaped @@; otherwise
+ * return false and let snapshotedit() build the unescaped copy.
+ */
+{
+    editline_t *p, *lim, *l = Gline(eb);
+
+    eb->Gspancount = 0;
+    *len = 0;
+    for (p=l, lim=l+Ggap(eb);  p<lim;  p++) {
+	if (p->has_stringdelim)
+	    return false;
+	span_append(eb, p->ptr, p->length);
+	if (eb->Gorigins)
+	    note_origin(eb, p->ptr, p->length);
+	*len += p->length;
+    }
+    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  p++) {
+	if (p->has_stringdelim)
+	    return false;
+	span_append(eb, p->ptr, p->length);
+	if (eb->Gorigins)
+	    note_origin(eb, p->ptr, p->length);
+	*len += p->length;
+    }
+    return true;
+}
+#endif
+
+static size_t resident_bytes(const editbuffer_t *const eb)
+/* generator storage that is in memory right now */
+{
+    const struct frame *f;
+    size_t total = eb->Goutbuf->size;
+
+    for (f = eb->stack; f <= eb->current; f++)
+	if (!f->spilled)
+	    total += sizeof(line_t) * f->linemax;
+    return total;
+}
+
+static void spill_frame(editbuffer_t *eb, struct frame *f)
+/* write the lines of frame F to the spill file, without its gap */
+{
+    size_t lines = f->linemax - f->gapsize, tail = lines - f->gap;
+
+    if (eb->Gspill == NULL && (eb->Gspill = tmpfile()) == NULL)
+	fatal_system_error("cannot create spill file for %s", eb->Gfilename);
+    f->spill_offset = eb->Gspillend;
+    if (fseeko(eb->Gspill, f->spill_offset, SEEK_SET) != 0
+	|| fwrite(f->line, sizeof(line_t), f->gap, eb->Gspill) != f->gap
+	|| fwrite(f->line + f->gap + f->gapsize, sizeof(line_t), tail,
+		  eb->Gspill) != tail)
+	fatal_system_error("write to spill file failed for %s", eb->Gfilename);
+    eb->Gspillend += sizeof(line_t) * lines;
+    f->spilled = true;
+}
+
+static void read_spill(editbuffer_t *eb, const struct frame *const f,
+		       line_t *to)
+/* read the lines of spilled frame F into TO; they have no gap there */
+{
+    size_t lines = f->linemax - f->gapsize;
+
+    if (fseeko(eb->Gspill, f->spill_offset, SEEK_SET) != 0
+	|| fread(to, sizeof(line_t), lines, eb->Gspill) != lines)
+	fatal_system_error("read from spill file failed for %s", eb->Gfilename);
+}
+
+static void unspill(editbuffer_t *eb)
+/* bring the current frame back from the spill file */
+{
+    Gline(eb) = xmalloc(sizeof(line_t) * Glinemax(eb), "unspill");
+    read_spill(eb, eb->current, Gline(eb));
+    Ggap(eb) = Glinemax(eb) - Ggapsize(eb);
+    eb->Gspillend = eb->current->spill_offset;
+    eb->current->spilled = false;
+}
+
+static void enter_branch(editbuffer_t *eb, const node_t *const node)
+{
+    struct frame *parent = eb->current;
+    line_t *p = NULL;
+    bool unspilled = false;
+
+    if (parent->whole)
+	/* a whole-text frame needs no line array of its own */;
+    else if (parent->spilled) {
+	p = xmalloc(sizeof(line_t) * parent->linemax, "enter branch");
+	read_spill(eb, parent, p);
+	unspilled = true;
+    } else if (eb->Gbudget > 0 && resident_bytes(eb)
+	       + sizeof(line_t) * parent->linemax > eb->Gbudget) {
+	/* rather than copy, hand the array down and park the parent */
+	spill_frame(eb, parent);
+	p = parent->line;
+	parent->line = NULL;
+    } else {
+	p = xmalloc(sizeof(line_t) * parent->linemax, "enter branch");
+	memcpy(p, parent->line, sizeof(line_t) * parent->linemax);
+    }
     ++eb->current;
     eb->current[0] = eb->current[-1];
     eb->current->next_branch = node->sib;
     eb->current->line = p;
-#else
-    uchar **p = xmalloc(sizeof(uchar *) * eb->current->linemax, "enter branch");
-	memcpy(p, eb->current->line, sizeof(uchar *) * eb->current->linemax);
-	++eb->current;
-	eb->current[0] = eb->current[-1];
-	eb->current->next_branch = node->sib;
-	eb->current->line = p;
-#endif
+    eb->current->spilled = false;
+    if (unspilled)
+	Ggap(eb) = Glinemax(eb) - Ggapsize(eb);
+    if (eb->current->whole)
+	Glinemax(eb) = Ggap(eb) = Ggapsize(eb) = 0;
 }
 
 static node_t *generate_setup(generator_t *gen, enum expand_mode id_token_expand)
@@ -1046,6 +1691,7 @@ static node_t *generate_setup(generator_t *gen, enum expand_mode id_token_expand
 
 	eb->Gkeyval = NULL;
 	eb->Gkvlen = 0;
+	eb->Gdate_version = NULL;
 
 	eb->current = eb->stack;
 	eb->Gfilename = gen->master_name;
@@ -1059,6 +1705,18 @@ static node_t *generate_setup(generator_t *gen, enum expand_mode id_token_expand
 	    eb->Gexpand = EXPANDKKV;
 	eb->Gabspath = NULL;
 	Gline(eb) = NULL; Ggap(eb) = Ggapsize(eb) = Glinemax(eb) = 0;
+	eb->current->whole = false;
+	eb->current->spilled = false;
+	eb->Gcompose = NULL;
+	eb->Gspill = NULL;
+	eb->Gspillend = 0;
+	eb->Gorigin = NULL;
+	eb->Gorigincount = eb->Goriginmax = 0;
+	out_buffer_init(eb);
+#ifdef LINESTATS
+	eb->Gspan = NULL;
+	eb->Gspancount = eb->Gspanmax = 0;
+#endif
     }
 
     return gen->nodehash.head_node;
@@ -1072,62 +1730,207 @@ static void generate_wrap(generator_t *gen)
     eb->Gkeyval = NULL;
     eb->Gkvlen = 0;
     free(eb->Gabspath);
+    out_buffer_cleanup(eb);
+    compose_free(eb);
+    if (eb->Gspill != NULL) {
+	fclose(eb->Gspill);
+	eb->Gspill = NULL;
+    }
+    free(eb->Gorigin);
+    eb->Gorigin = NULL;
+#ifdef LINESTATS
+    free(eb->Gspan);
+    eb->Gspan = NULL;
+#endif
     unload_all_text(eb);
 }
 
+static void emit_snapshot(editbuffer_t *eb, node_t *node,
+			  export_options_t *opts,
+			  void(*hook)(node_t *node,
+				      const struct iovec *iov, int iovcnt,
+				      size_t len,
+				      const line_origin_t *origin,
+				      size_t norigin,
+				      export_options_t *opts))
+/* pass the current revision state to the export hook */
+{
+    struct frame *f = eb->current;
+    struct iovec whole;
+
+    eb->Gorigincount = 0;
+
+    if (f->whole) {
+	const uchar *p = f->whole_text, *end = p + f->whole_len, *at;
+	if (!f->whole_delim) {
+	    whole.iov_base = f->whole_text;
+	    whole.iov_len = f->whole_len;
+	    hook(node, &whole, 1, whole.iov_len, NULL, 0, opts);
+	    return;
+	}
+	/* every @ in the span is doubled; keep one of each pair */
+	out_buffer_reset(eb);
+	while ((at = memchr(p, SDELIM, end - p)) != NULL) {
+	    out_awrite(eb, (const char *)p, at + 1 - p);
+	    p = at + 2;
+	}
+	out_awrite(eb, (const char *)p, end - p);
+	whole.iov_base = out_buffer_text(eb);
+	whole.iov_len = out_buffer_count(eb);
+	hook(node, &whole, 1, whole.iov_len, NULL, 0, opts);
+	return;
+    }
+#ifdef LINESTATS
+    size_t len;
+
+    /* unexpanded text can often go out without being copied */
+    if (eb->Gexpand >= EXPANDKO && spanedit(eb, &len)) {
+	hook(node, eb->Gspan, eb->Gspancount, len,
+	     eb->Gorigin, eb->Gorigincount, opts);
+	return;
+    }
+    eb->Gorigincount = 0;
+#endif
+    out_buffer_reset(eb);
+    if (eb->Gorigins)
+	originedit(eb);
+    else if (eb->Gexpand < EXPANDKO)
+	expandedit(eb);
+    else
+	snapshotedit(eb);
+    whole.iov_base = out_buffer_text(eb);
+    whole.iov_len = out_buffer_count(eb);
+    hook(node, &whole, 1, whole.iov_len, eb->Gorigin, eb->Gorigincount, opts);
+}
+
+static bool mark_needed(node_t *node)
+/*
+ * Flag the nodes along the delta chain starting at NODE, and along the
+ * branches hanging off it, that must be visited to reach a wanted
+ * revision.  Returns true if there are any.
+ */
+{
+    node_t *n, *b, *last = NULL;
+
+    for (n = node; n; n = n->to) {
+	bool need = n->commit != NULL && n->commit->wanted;
+	for (b = n->down; b; b = b->sib)
+	    if (mark_needed(b))
+		need = true;
+	if (need)
+	    last = n;
+	n->needed = false;
+    }
+    if (last == NULL)
+	return false;
+    for (n = node; n != last->to; n = n->to)
+	n->needed = true;
+    return true;
+}
+
+static node_t *next_needed(node_t *node, const bool partial)
+/* NODE, or NULL if nothing wanted lies along it */
+{
+    return (partial && node != NULL && !node->needed) ? NULL : node;
+}
+
+static node_t *next_needed_branch(node_t *node, const bool partial)
+/* the first branch from NODE onwards that leads to something wanted */
+{
+    while (partial && node != NULL && !node->needed)
+	node = node->sib;
+    return node;
+}
+
+static bool wanted_text(const node_t *const node, const bool partial)
+/* will the text of the revision at NODE be emitted? */
+{
+    return node->commit != NULL && !node->commit->dead
+	&& (!partial || node->commit->wanted);
+}
+
+static void walk_revisions(node_t *node, void (*visit)(cvs_commit *rev))
+{
+    node_t *b;
+
+    for (; node; node = node->to) {
+	if (node->commit != NULL)
+	    visit(node->commit);
+	for (b = node->down; b; b = b->sib)
+	    walk_revisions(b, visit);
+    }
+}
+
+void generate_revisions(generator_t *gen, void (*visit)(cvs_commit *rev))
+/* visit every revision generate_files() could emit, without generating */
+{
+    walk_revisions(gen->nodehash.head_node, visit);
+}
+
 void generate_files(generator_t *gen,
 		    export_options_t *opts,
-		    void(*hook)(node_t *node, void *buf, size_t len, export_options_t *opts))
+		    void(*hook)(node_t *node,
+				const struct iovec *iov, int iovcnt, size_t len,
+				const line_origin_t *origin, size_t norigin,
+				export_options_t *opts))
 /* export all the revision states of a CVS/RCS master through a hook */
 {
     editbuffer_t *eb = &gen->editbuffer;
-    node_t *node = generate_setup(gen, opts->id_token_expand);
+    /*
+     * An incremental dump only ships the revisions export has flagged
+     * as wanted, so deltas are applied only along the paths that lead
+     * to one of those; a master with none is never even opened.  The
+     * blob cache regenerates masters the same way, and imported marks
+     * leave only the revisions they do not name.
+     */
+    bool partial = opts->fromtime > 0 || opts->blobcache > 0
+	|| opts->import_marks != NULL;
+    node_t *node;
 
+    if (partial && gen->nodehash.head_node != NULL
+		&& !mark_needed(gen->nodehash.head_node))
+	return;
+    node = generate_setup(gen, opts->id_token_expand);
     if (node == NULL)
 	return;
+    eb->Gbudget = opts->membudget;
+    eb->Gorigins = opts->packdeltas;
 
     eb->current->node = node;
     eb->current->node_text = load_text(eb, &node->patch->text);
-    process_delta(eb, node, ENTER);
+    enter_text(eb, node);
     for (;;) {
-	/*
-	 * Revisions are written backwards in time starting from the tip,
-	 * so if we're incremental-dumping we can just stop on the
-	 * first that's too old.
-	 */
-	if (node->commit && opts->fromtime >= node->commit->date)
-	    goto Done;
-	if (node->commit != NULL && !node->commit->dead) {
-	    out_buffer_init(eb);
-	    if (eb->Gexpand < EXPANDKO)
-		expandedit(eb);
-	    else
-		snapshotedit(eb);
-	    hook(node, out_buffer_text(eb), out_buffer_count(eb), opts);
-	    out_buffer_cleanup(eb);
-	}
-	node = node->down;
+	if (wanted_text(node, partial))
+	    emit_snapshot(eb, node, opts, hook);
+	node = next_needed_branch(node->down, partial);
 	if (node) {
 	    enter_branch(eb, node);
 	    goto Next;
 	}
-	while ((node = eb->current->node->to) == NULL) {
+	while ((node = next_needed(eb->current->node->to, partial)) == NULL) {
 	    unload_text(eb, &eb->current->node->patch->text,
 	                eb->current->node_text);
+	    compose_discard(eb);
 	    free(eb->current->line);
 	    if (eb->current == eb->stack)
 		goto Done;
-	    node = (node_t *)eb->current->next_branch;
+	    node = next_needed_branch(eb->current->next_branch, partial);
 	    --eb->current;
 	    if (node) {
 		enter_branch(eb, node);
 		break;
 	    }
+	    if (eb->current->spilled)
+		unspill(eb);
 	}
     Next:
 	eb->current->node = node;
 	eb->current->node_text = load_text(eb, &node->patch->text);
-	process_delta(eb, node, EDIT);
+	if (!wanted_text(node, partial)
+		&& next_needed_branch(node->down, partial) == NULL)
+	    skip_delta(eb, node);
+	else
+	    apply_delta(eb, node);
     }
 Done:
     generate_wrap(gen);
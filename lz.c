@@ -0,0 +1,172 @@
+/*
+ * A small LZ77 codec, for keeping spooled blobs compact.
+ *
+ * The format is that of LZ4 blocks.  Each sequence is a token byte
+ * whose nibbles count literals and match bytes past the minimum of 4,
+ * then the literals, then the distance back to the match as two
+ * little-endian bytes.  A nibble of 15 is followed by bytes that add to
+ * the count until one is below 255.  The last sequence is literals
+ * only.  Compression is greedy with a single hash probe per position,
+ * trading ratio for speed; source code still shrinks to about half.
+ *
+ *  SPDX-License-Identifier: GPL-2.0+
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MINMATCH	4
+#define HASHBITS	16
+#define WINDOW		65535
+
+/*
+ * Where 4-byte sequences were last seen, as BASE plus their position.
+ * BASE moves past every input, so entries from earlier calls never
+ * match and the table need not be cleared between blobs.
+ */
+static uint32_t table[1 << HASHBITS];
+static uint32_t base = 1;
+
+static uint32_t
+read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int
+hash4(const uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASHBITS);
+}
+
+static unsigned char *
+put_count(unsigned char *op, size_t n)
+/* the part of a count of 15 or more that does not fit its nibble */
+{
+    for (n -= 15; n >= 255; n -= 255)
+	*op++ = 255;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+static unsigned char *
+put_sequence(unsigned char *op, const unsigned char *lit, const size_t nlit,
+	     const size_t distance, const size_t mlen)
+/* NLIT literals, then a match unless MLEN is 0 */
+{
+    unsigned char *token = op++;
+
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+	op = put_count(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen > 0) {
+	*op++ = distance & 0xff;
+	*op++ = (distance >> 8) & 0xff;
+	*token |= mlen - MINMATCH < 15 ? mlen - MINMATCH : 15;
+	if (mlen - MINMATCH >= 15)
+	    op = put_count(op, mlen - MINMATCH);
+    }
+    return op;
+}
+
+size_t
+lz_compress(const unsigned char *in, const size_t len, unsigned char *out)
+{
+    unsigned char *op = out;
+    size_t ip = 0, anchor = 0;
+
+    /* positions must fit the table; a huge blob goes out as literals */
+    if (len < UINT32_MAX / 2) {
+	if (base > UINT32_MAX - len - 1) {
+	    memset(table, 0, sizeof(table));
+	    base = 1;
+	}
+	while (ip + MINMATCH <= len) {
+	    const uint32_t seq = read32(in + ip);
+	    const unsigned int h = hash4(seq);
+	    const uint32_t here = base + (uint32_t)ip, seen = table[h];
+
+	    table[h] = here;
+	    if (seen >= base && here - seen <= WINDOW
+		&& read32(in + (seen - base)) == seq) {
+		const size_t ref = seen - base;
+		size_t mlen = MINMATCH;
+
+		while (ip + mlen < len && in[ref + mlen] == in[ip + mlen])
+		    mlen++;
+		op = put_sequence(op, in + anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	    } else
+		/* stride further through text that is not matching */
+		ip += 1 + ((ip - anchor) >> 6);
+	}
+	base += (uint32_t)len + 1;
+    }
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+    return op - out;
+}
+
+static bool
+get_count(const unsigned char *in, const size_t inlen, size_t *ip, size_t *n)
+{
+    unsigned char b;
+
+    do {
+	if (*ip >= inlen)
+	    return false;
+	b = in[(*ip)++];
+	*n += b;
+    } while (b == 255);
+    return true;
+}
+
+bool
+lz_decompress(const unsigned char *in, const size_t inlen,
+	      unsigned char *out, const size_t outlen)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < inlen) {
+	const unsigned int token = in[ip++];
+	size_t nlit = token >> 4, mlen = token & 15, distance;
+
+	if (nlit == 15 && !get_count(in, inlen, &ip, &nlit))
+	    return false;
+	if (nlit > inlen - ip || nlit > outlen - op)
+	    return false;
+	memcpy(out + op, in + ip, nlit);
+	ip += nlit;
+	op += nlit;
+	if (ip == inlen)
+	    break;
+
+	if (inlen - ip < 2)
+	    return false;
+	distance = in[ip] | (size_t)in[ip + 1] << 8;
+	ip += 2;
+	if (mlen == 15 && !get_count(in, inlen, &ip, &mlen))
+	    return false;
+	mlen += MINMATCH;
+	if (distance == 0 || distance > op || mlen > outlen - op)
+	    return false;
+	if (distance >= mlen)
+	    memcpy(out + op, out + op - distance, mlen);
+	else {
+	    /* the match overlaps what it is copying, repeating it */
+	    size_t i;
+	    for (i = 0; i < mlen; i++)
+		out[op + i] = out[op + i - distance];
+	}
+	op += mlen;
+    }
+    return op == outlen;
+}
+
+/* end */
@@ -0,0 +1,19 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* the most lz_compress() can write for LEN bytes of input */
+#define LZ_BOUND(len)	((len) + (len) / 255 + 16)
+
+/* compress LEN bytes into OUT, which holds LZ_BOUND(LEN); not reentrant */
+size_t
+lz_compress(const unsigned char *in, const size_t len, unsigned char *out);
+
+/* expand INLEN bytes into exactly OUTLEN; false if the input is damaged */
+bool
+lz_decompress(const unsigned char *in, const size_t inlen,
+	      unsigned char *out, const size_t outlen);
+
+#endif /* _LZ_H_ */
@@ -110,6 +110,24 @@ static time_t convert_date(const char *dte)
     }
 }
 
+static size_t convert_size(const char *arg)
+/* parse a byte count with an optional k, m or g suffix */
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+
+    switch (tolower((unsigned char)*end)) {
+    case 'g': n <<= 10;	/* fall through */
+    case 'm': n <<= 10;	/* fall through */
+    case 'k': n <<= 10; end++; break;
+    case '\0': break;
+    default: end = (char *)arg;
+    }
+    if (end == arg || *end != '\0')
+	fatal_error("invalid size %s", arg);
+    return (size_t)n;
+}
+
 static void print_sizes(void)
 {
     printf("sizeof(char *)        = %zu\n", sizeof(char *));
@@ -228,6 +246,15 @@ main(int argc, char **argv)
             { "canonical",          0, 0, 'C' },
             { "fast",               0, 0, 'F' },
             { "embed-id",           0, 0, 'E' },
+            { "memory-budget",      1, 0, 'M' },
+            { "pack",               1, 0, 'O' },
+            { "pack-deltas",        0, 0, 'D' },
+            { "compress-spool",     0, 0, 'Z' },
+            { "blob-cache",         1, 0, 'K' },
+            { "checkpoint",         1, 0, 'Y' },
+            { "resume",             0, 0, 'U' },
+            { "import-marks",       1, 0, 'I' },
+            { "export-marks",       1, 0, 'J' },
 	    { "sizes",              0, 0, 'S' },	/* undocumented */
 	    { NULL,                 0, 0, '\0'}, 
 	};
@@ -263,6 +290,15 @@ main(int argc, char **argv)
 		   " -i --incremental=TIME           Incremental dump beginning after specified RFC3339-format TIME.\n"
 		   " -t --threads=N                  Use threaded scheduler with N threads for CVS master analyses.\n"
 		   " -E --embed-id                   Embed CVS revisions in the commit messages.\n"
+		   "    --memory-budget=SIZE         Bound the line storage of each snapshot generator.\n"
+		   "    --pack=GITDIR                Write a pack and refs into GITDIR, not a stream.\n"
+		   "    --pack-deltas                Store blobs in the pack as deltas from the RCS edits.\n"
+		   "    --compress-spool             Compress blobs held for canonical order.\n"
+		   "    --blob-cache=SIZE            Hold canonical-order blobs in memory, not a spool.\n"
+		   "    --checkpoint=FILE            Record in FILE how much of the stream is out.\n"
+		   "    --resume                     Continue the stream from the checkpoint.\n"
+		   "    --import-marks=FILE          Leave out blobs and commits FILE has marks for.\n"
+		   "    --export-marks=FILE          Record marks of blobs and commits in FILE.\n"
 		   "\n"
 		   "Example: find | cvs-fast-export\n");
 	    return 0;
@@ -334,6 +370,43 @@ main(int argc, char **argv)
 	    assert(optarg);
 	    export_options.tag_prefix = optarg;
 	    break;
+	case 'M':
+	    assert(optarg);
+	    export_options.membudget = convert_size(optarg);
+	    break;
+	case 'O':
+#ifdef GITPACK
+	    assert(optarg);
+	    export_options.packdir = optarg;
+#else
+	    fatal_error("not built with pack support, --pack is unavailable.\n");
+#endif
+	    break;
+	case 'D':
+	    export_options.packdeltas = true;
+	    break;
+	case 'Z':
+	    export_options.compress_spool = true;
+	    break;
+	case 'K':
+	    assert(optarg);
+	    export_options.blobcache = convert_size(optarg);
+	    break;
+	case 'Y':
+	    assert(optarg);
+	    export_options.checkpoint = optarg;
+	    break;
+	case 'U':
+	    export_options.resume = true;
+	    break;
+	case 'I':
+	    assert(optarg);
+	    export_options.import_marks = optarg;
+	    break;
+	case 'J':
+	    assert(optarg);
+	    export_options.export_marks = optarg;
+	    break;
 	case 's':
 	    assert(optarg);
 	    import_options.striplen = strlen(optarg);
@@ -375,6 +448,22 @@ main(int argc, char **argv)
 	if (export_options.embed_ids)
 	    fatal_error("The options --reposurgeon and --embed-id cannot be combined.\n");
     }
+    if (export_options.packdir != NULL) {
+	if (export_options.reposurgeon)
+	    fatal_error("The options --pack and --reposurgeon cannot be combined.\n");
+	if (export_options.fromtime > 0)
+	    fatal_error("The options --pack and --incremental cannot be combined.\n");
+	if (export_options.checkpoint != NULL)
+	    fatal_error("The options --pack and --checkpoint cannot be combined.\n");
+	if (export_options.import_marks != NULL || export_options.export_marks != NULL)
+	    fatal_error("The option --pack cannot be combined with marks files.\n");
+    } else if (export_options.packdeltas)
+	fatal_error("The option --pack-deltas needs --pack.\n");
+    if (export_options.resume && export_options.checkpoint == NULL)
+	fatal_error("The option --resume needs --checkpoint.\n");
+    if (export_options.fromtime > 0
+	&& (export_options.import_marks != NULL || export_options.export_marks != NULL))
+	fatal_error("The option --incremental cannot be combined with marks files.\n");
 
     argv[optind-1] = argv[0];
     argv += optind-1;
@@ -386,6 +475,9 @@ main(int argc, char **argv)
 	threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
 #endif /*  _SC_NPROCESSORS_ONLN */
 #endif
+    /* --resume replays the stream, and only serial analysis repeats it */
+    if (export_options.checkpoint != NULL)
+	threads = 0;
 
     gather_stats("before parsing");
 
@@ -394,6 +486,12 @@ main(int argc, char **argv)
 
     gather_stats("after parsing");
 
+    /* blobs need no changesets, so they can be on their way already */
+    if (exec_mode == ExecuteExport) {
+	export_snapshots(&forest, &export_options);
+	gather_stats("after snapshot generation");
+    }
+
     /* commit set coalescence happens here */
     forest.git = collate_to_changesets(forest.cvs, 
 				     forest.filecount,
@@ -416,6 +514,11 @@ main(int argc, char **argv)
 		fclose(export_options.revision_map);
 	    break;
 	}
+    } else if (exec_mode == ExecuteExport) {
+	/* the snapshots went out before collation failed */
+	export_abort(&export_options);
+	if (export_options.revision_map != NULL)
+	    fclose(export_options.revision_map);
     }
 
     gather_stats("total");
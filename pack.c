@@ -0,0 +1,1199 @@
+/*
+ * Write git objects straight into a pack, as an alternative to handing
+ * a fast-import stream to git.
+ *
+ * Objects are named as they arrive, deflated, and appended to a
+ * temporary pack under objects/pack; a name already seen is not
+ * written twice.  With threads, naming and deflating are done by a
+ * pool of workers while one writer keeps the pack in order.  When the
+ * export is done the object count is patched into the header, the
+ * trailing checksum and a version 2 index are written, and the refs
+ * go into packed-refs.
+ *
+ *  SPDX-License-Identifier: GPL-2.0+
+ */
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cvs.h"
+#include "pack.h"
+
+#ifdef GITPACK
+#include <zlib.h>
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
+
+/* an object already in the pack */
+struct packed {
+    unsigned char	sha[SHA1_RAWSZ];
+    uint32_t		crc;
+    uint64_t		offset;
+    int			depth;		/* deltas between it and a whole object */
+};
+
+/* object names, open-addressed on the name, holding index + 1 */
+struct objset {
+    struct packed	*objects;
+    size_t		count, max;
+    size_t		*slots;
+    size_t		nslots;
+};
+
+/* an entry header and deflated data, ready to append to the pack */
+struct encoded {
+    unsigned char	*out;
+    size_t		len, max;
+    size_t		hdrlen;		/* a delta's base offset goes here */
+    uint32_t		crc;
+};
+
+/*
+ * The blob last passed to pack_blob(), which the next one from the
+ * same master may be stored as a delta against.  Lines are found in
+ * it by their origin, in a table holding line index + 1.
+ */
+static struct {
+    unsigned char	*text;
+    size_t		len, max;
+    line_origin_t	*origin;
+    size_t		*start;		/* offset of each line in text */
+    size_t		norigin, maxorigin;
+    size_t		*slots, nslots;
+    unsigned char	*sha;		/* its name, possibly not yet known */
+    int			depth;		/* deltas between it and a whole blob */
+    bool		valid;
+} base;
+
+/* the next base being assembled, and the delta against the current one */
+static struct {
+    unsigned char	*text;
+    size_t		max;
+    unsigned char	*delta;
+    size_t		deltamax;
+} scratch;
+
+/* as git pack-objects does by default, to keep reading blobs cheap */
+#define DELTA_DEPTH	50
+/* a copy instruction of at most this much is readable by any git */
+#define DELTA_COPY_MAX	0x10000
+
+struct packref {
+    char		*name;
+    unsigned char	sha[SHA1_RAWSZ];
+    size_t		order;		/* later refs of one name win */
+};
+
+static char gitdir[PATH_MAX], tmppack[PATH_MAX];
+static FILE *packfp;
+static uint64_t packoff;
+static z_stream zs;
+static struct encoded serial_entry;
+
+/* what is in the pack file */
+static struct objset packset;
+
+static struct packref *refs;
+static size_t nrefs, maxrefs;
+
+static const char *const type_name[] = {
+    [PACK_COMMIT] = "commit",
+    [PACK_TREE] = "tree",
+    [PACK_BLOB] = "blob",
+    [PACK_TAG] = "tag",
+};
+
+#ifdef THREADS
+/*
+ * With more than one thread the work is split in three: the caller
+ * copies each object into a ring of jobs, a pool of workers names
+ * and deflates them, and a single writer appends them to the pack in
+ * the order they were submitted, so offsets do not depend on which
+ * worker finishes first.  The ring and a cap on the bytes in flight
+ * hold the caller back when the workers fall behind.
+ */
+#define PIPE_DEPTH	64
+#define PIPE_BYTES	(64 * 1024 * 1024)
+
+struct job {
+    enum pack_type	type;
+    bool		named;		/* sha filled in by the caller */
+    unsigned char	sha[SHA1_RAWSZ];
+    unsigned char	*dest;		/* where to report the name */
+    const unsigned char	*base;		/* name of the delta base, if any */
+    unsigned char	*data;		/* the object, then its delta */
+    size_t		len, deltalen, datamax;
+    struct encoded	entry;
+    bool		done;
+};
+
+static struct job ring[PIPE_DEPTH];
+static size_t submitted, claimed, written, inflight;
+static bool draining;
+static int nworkers;
+static pthread_t *workers, writer;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+/* names handed to the pipeline by pack_object(), to skip duplicates early */
+static struct objset named;
+#endif /* THREADS */
+
+static void
+git_path(char *buf, const char *fmt, ...)
+/* format a path of at most PATH_MAX bytes into BUF */
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, PATH_MAX, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= PATH_MAX)
+	fatal_error("path under %s is too long", gitdir);
+}
+
+static size_t
+sha_slot(const struct objset *set, const unsigned char *sha)
+{
+    size_t h;
+
+    /* object names are uniformly distributed already */
+    memcpy(&h, sha, sizeof(h));
+    return h & (set->nslots - 1);
+}
+
+static struct packed *
+lookup_object(const struct objset *set, const unsigned char *sha)
+{
+    size_t i;
+
+    if (set->nslots == 0)
+	return NULL;
+    for (i = sha_slot(set, sha); set->slots[i] != 0;
+	 i = (i + 1) & (set->nslots - 1))
+	if (memcmp(set->objects[set->slots[i] - 1].sha, sha, SHA1_RAWSZ) == 0)
+	    return &set->objects[set->slots[i] - 1];
+    return NULL;
+}
+
+static void
+grow_slots(struct objset *set)
+/* keep the name index at most half full */
+{
+    size_t i, j;
+
+    free(set->slots);
+    set->nslots = set->nslots ? set->nslots * 2 : 65536;
+    set->slots = xcalloc(set->nslots, sizeof(size_t), "pack index");
+    for (j = 0; j < set->count; j++) {
+	for (i = sha_slot(set, set->objects[j].sha); set->slots[i] != 0;
+	     i = (i + 1) & (set->nslots - 1))
+	    continue;
+	set->slots[i] = j + 1;
+    }
+}
+
+static struct packed *
+add_object(struct objset *set, const unsigned char *sha)
+{
+    size_t i;
+
+    if (set->count == set->max) {
+	set->max = set->max ? set->max * 2 : 4096;
+	set->objects = xrealloc(set->objects,
+				sizeof(struct packed) * set->max,
+				"pack objects");
+    }
+    if (2 * (set->count + 1) > set->nslots)
+	grow_slots(set);
+    memcpy(set->objects[set->count].sha, sha, SHA1_RAWSZ);
+    for (i = sha_slot(set, sha); set->slots[i] != 0;
+	 i = (i + 1) & (set->nslots - 1))
+	continue;
+    set->slots[i] = ++set->count;
+    return &set->objects[set->count - 1];
+}
+
+static void
+free_objset(struct objset *set)
+{
+    free(set->objects);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+static void
+pack_write(const void *buf, const size_t len)
+{
+    if (fwrite(buf, 1, len, packfp) != len)
+	fatal_system_error("write to %s failed", tmppack);
+    packoff += len;
+}
+
+static void
+name_object(const enum pack_type type,
+	    const struct iovec *iov, const int iovcnt, const size_t len,
+	    unsigned char sha[SHA1_RAWSZ])
+/* compute the git name of an object */
+{
+    char hdr[32];
+    sha1_ctx ctx;
+    int i;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, hdr, snprintf(hdr, sizeof(hdr), "%s %zu",
+				    type_name[type], len) + 1);
+    for (i = 0; i < iovcnt; i++)
+	sha1_update(&ctx, iov[i].iov_base, iov[i].iov_len);
+    sha1_final(&ctx, sha);
+}
+
+static uint32_t
+crc_update(uint32_t crc, const unsigned char *p, size_t len)
+/* crc32() over a buffer that may not fit in an unsigned int */
+{
+    while (len > 0) {
+	size_t chunk = len < (UINT_MAX >> 1) ? len : (UINT_MAX >> 1);
+	crc = crc32(crc, p, (unsigned int)chunk);
+	p += chunk;
+	len -= chunk;
+    }
+    return crc;
+}
+
+static void
+encode_entry(z_stream *strm, const enum pack_type type,
+	     const struct iovec *iov, const int iovcnt, size_t len,
+	     struct encoded *entry)
+/* the entry header, then the spans compressed as one zlib stream */
+{
+    size_t n = 0, need = 16 + deflateBound(strm, len);
+    int i, status;
+
+    if (entry->max < need) {
+	entry->max = need;
+	entry->out = xrealloc(entry->out, entry->max, "pack entry");
+    }
+    /* type and inflated size, in the pack's variable-length encoding */
+    entry->out[n] = (unsigned char)((type << 4) | (len & 0x0f));
+    for (len >>= 4; len > 0; len >>= 7) {
+	entry->out[n++] |= 0x80;
+	entry->out[n] = len & 0x7f;
+    }
+    entry->hdrlen = ++n;
+
+    if (deflateReset(strm) != Z_OK)
+	fatal_error("zlib deflate reset failed");
+    for (i = 0; i <= iovcnt; i++) {
+	const unsigned char *p = i < iovcnt ? iov[i].iov_base : NULL;
+	size_t left = i < iovcnt ? iov[i].iov_len : 0;
+	int flush = i < iovcnt ? Z_NO_FLUSH : Z_FINISH;
+
+	do {
+	    /* avail_in and avail_out are only unsigned ints wide */
+	    size_t chunk = left < (UINT_MAX >> 1) ? left : (UINT_MAX >> 1);
+	    strm->next_in = (unsigned char *)p;
+	    strm->avail_in = (unsigned int)chunk;
+	    do {
+		size_t room;
+		if (n == entry->max) {
+		    entry->max *= 2;
+		    entry->out = xrealloc(entry->out, entry->max, "pack entry");
+		}
+		room = entry->max - n;
+		if (room > (UINT_MAX >> 1))
+		    room = UINT_MAX >> 1;
+		strm->next_out = entry->out + n;
+		strm->avail_out = (unsigned int)room;
+		status = deflate(strm, flush);
+		if (status == Z_STREAM_ERROR)
+		    fatal_error("zlib deflate failed");
+		n += room - strm->avail_out;
+	    } while (strm->avail_in > 0 || strm->avail_out == 0
+		     || (flush == Z_FINISH && status != Z_STREAM_END));
+	    p += chunk;
+	    left -= chunk;
+	} while (left > 0);
+    }
+    entry->len = n;
+    entry->crc = crc_update(crc32(0L, Z_NULL, 0), entry->out, n);
+}
+
+static void
+write_entry(const unsigned char *sha, const struct encoded *entry,
+	    const unsigned char *basesha)
+/*
+ * Append an encoded object unless one of that name is already there.
+ * A delta gets the distance back to BASESHA after its entry header.
+ */
+{
+    struct packed *obj;
+    unsigned char ofs[10];
+    size_t pos = sizeof(ofs);
+    uint64_t distance;
+    int depth;
+
+    if (lookup_object(&packset, sha) != NULL)
+	return;
+    if (basesha == NULL) {
+	obj = add_object(&packset, sha);
+	obj->offset = packoff;
+	obj->crc = entry->crc;
+	obj->depth = 0;
+	pack_write(entry->out, entry->len);
+	return;
+    }
+
+    if ((obj = lookup_object(&packset, basesha)) == NULL)
+	fatal_error("delta base missing from pack");
+    depth = obj->depth + 1;
+    distance = packoff - obj->offset;
+    ofs[--pos] = distance & 0x7f;
+    while ((distance >>= 7) > 0)
+	ofs[--pos] = 0x80 | (--distance & 0x7f);
+
+    obj = add_object(&packset, sha);
+    obj->offset = packoff;
+    obj->depth = depth;
+    obj->crc = crc32(0L, Z_NULL, 0);
+    obj->crc = crc_update(obj->crc, entry->out, entry->hdrlen);
+    obj->crc = crc_update(obj->crc, ofs + pos, sizeof(ofs) - pos);
+    obj->crc = crc_update(obj->crc, entry->out + entry->hdrlen,
+			  entry->len - entry->hdrlen);
+    pack_write(entry->out, entry->hdrlen);
+    pack_write(ofs + pos, sizeof(ofs) - pos);
+    pack_write(entry->out + entry->hdrlen, entry->len - entry->hdrlen);
+}
+
+#ifdef THREADS
+static void *
+pack_worker(void *arg)
+/* name and deflate jobs in the order they were submitted */
+{
+    z_stream strm;
+    struct job *job;
+    struct iovec iov;
+
+    (void)arg;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+	fatal_error("zlib initialization failed");
+    pthread_mutex_lock(&pipe_mutex);
+    for (;;) {
+	while (claimed == submitted && !draining)
+	    pthread_cond_wait(&work_cond, &pipe_mutex);
+	if (claimed == submitted)
+	    break;
+	job = &ring[claimed++ % PIPE_DEPTH];
+	pthread_mutex_unlock(&pipe_mutex);
+
+	iov.iov_base = job->data;
+	iov.iov_len = job->len;
+	if (!job->named)
+	    name_object(job->type, &iov, 1, job->len, job->sha);
+	if (job->base != NULL) {
+	    iov.iov_base = job->data + job->len;
+	    iov.iov_len = job->deltalen;
+	    encode_entry(&strm, PACK_OFS_DELTA, &iov, 1, job->deltalen,
+			 &job->entry);
+	} else
+	    encode_entry(&strm, job->type, &iov, 1, job->len, &job->entry);
+
+	pthread_mutex_lock(&pipe_mutex);
+	job->done = true;
+	if (job == &ring[written % PIPE_DEPTH])
+	    pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&pipe_mutex);
+    deflateEnd(&strm);
+    return NULL;
+}
+
+static void *
+pack_writer(void *arg)
+/* append finished jobs to the pack, strictly in submission order */
+{
+    struct job *job;
+    const struct packed *from;
+    struct iovec whole;
+
+    (void)arg;
+    pthread_mutex_lock(&pipe_mutex);
+    for (;;) {
+	job = &ring[written % PIPE_DEPTH];
+	while (!(written < submitted && job->done)
+	       && !(draining && written == submitted))
+	    pthread_cond_wait(&done_cond, &pipe_mutex);
+	if (written == submitted)
+	    break;
+	pthread_mutex_unlock(&pipe_mutex);
+
+	from = job->base != NULL ? lookup_object(&packset, job->base) : NULL;
+	if (from != NULL && from->depth >= DELTA_DEPTH) {
+	    /*
+	     * The base duplicated an object stored as a deeper delta
+	     * than its chain counted, which is only known now.  Store
+	     * the blob whole; only this thread uses the serial encoder.
+	     */
+	    whole.iov_base = job->data;
+	    whole.iov_len = job->len;
+	    encode_entry(&zs, job->type, &whole, 1, job->len, &serial_entry);
+	    write_entry(job->sha, &serial_entry, NULL);
+	} else
+	    write_entry(job->sha, &job->entry, job->base);
+	if (job->dest != NULL)
+	    memcpy(job->dest, job->sha, SHA1_RAWSZ);
+
+	pthread_mutex_lock(&pipe_mutex);
+	job->done = false;
+	inflight -= job->len + job->deltalen;
+	written++;
+	pthread_cond_broadcast(&space_cond);
+    }
+    pthread_mutex_unlock(&pipe_mutex);
+    return NULL;
+}
+
+static void
+submit(const enum pack_type type,
+       const struct iovec *iov, const int iovcnt, const size_t len,
+       const unsigned char *delta, const size_t deltalen,
+       const unsigned char *basesha,
+       const unsigned char *sha, unsigned char *dest)
+/* copy an object, and any delta for it, into the ring, waiting for room */
+{
+    struct job *job;
+    unsigned char *p;
+    int i;
+
+    pthread_mutex_lock(&pipe_mutex);
+    while (submitted - written == PIPE_DEPTH
+	   || (inflight > 0 && inflight + len + deltalen > PIPE_BYTES))
+	pthread_cond_wait(&space_cond, &pipe_mutex);
+    job = &ring[submitted % PIPE_DEPTH];
+    inflight += len + deltalen;
+    pthread_mutex_unlock(&pipe_mutex);
+
+    /* nobody else touches a slot between its write and its submission */
+    if (job->datamax < len + deltalen) {
+	job->datamax = len + deltalen;
+	job->data = xrealloc(job->data, job->datamax, "pack job");
+    }
+    for (p = job->data, i = 0; i < iovcnt; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+    if (deltalen > 0)
+	memcpy(p, delta, deltalen);
+    job->type = type;
+    job->len = len;
+    job->deltalen = deltalen;
+    job->base = basesha;
+    job->named = sha != NULL;
+    if (sha != NULL)
+	memcpy(job->sha, sha, SHA1_RAWSZ);
+    job->dest = dest;
+
+    pthread_mutex_lock(&pipe_mutex);
+    submitted++;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&pipe_mutex);
+}
+#endif /* THREADS */
+
+static bool
+has_loose_refs(const char *dir)
+/* whether any ref file lies under DIR */
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    bool found = false;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+	return false;
+    while (!found && (de = readdir(dp)) != NULL) {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	git_path(path, "%s/%s", dir, de->d_name);
+	if (stat(path, &st) == 0)
+	    found = S_ISDIR(st.st_mode) ? has_loose_refs(path) : true;
+    }
+    (void)closedir(dp);
+    return found;
+}
+
+static bool
+has_packed_refs(void)
+/* whether packed-refs names any ref */
+{
+    char path[PATH_MAX], line[PATH_MAX + SHA1_HEXSZ + 2];
+    bool found = false;
+    FILE *fp;
+
+    git_path(path, "%s/packed-refs", gitdir);
+    if ((fp = fopen(path, "r")) == NULL)
+	return false;
+    while (!found && fgets(line, sizeof(line), fp) != NULL)
+	found = line[0] != '#';
+    (void)fclose(fp);
+    return found;
+}
+
+void
+pack_begin(const char *dir)
+{
+    static const unsigned char header[12] = {'P', 'A', 'C', 'K', 0, 0, 0, 2};
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    /* accept a work tree as well as the repository itself */
+    git_path(gitdir, "%s/.git", dir);
+    if (stat(gitdir, &st) != 0 || !S_ISDIR(st.st_mode))
+	git_path(gitdir, "%s", dir);
+    git_path(path, "%s/objects", gitdir);
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+	fatal_error("%s is not a git repository", dir);
+    /* packed-refs is written whole, and loose refs would shadow it */
+    git_path(path, "%s/refs", gitdir);
+    if (has_loose_refs(path) || has_packed_refs())
+	fatal_error("%s already has branches or tags", dir);
+    git_path(path, "%s/objects/pack", gitdir);
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+	fatal_system_error("cannot create %s", path);
+
+    git_path(tmppack, "%s/tmp_pack_XXXXXX", path);
+    if ((fd = mkstemp(tmppack)) < 0 || (packfp = fdopen(fd, "w+")) == NULL)
+	fatal_system_error("cannot create %s", tmppack);
+    setvbuf(packfp, NULL, _IOFBF, 1024 * 1024);
+    packoff = 0;
+    /* the object count is patched in by pack_end() */
+    pack_write(header, sizeof(header));
+
+    grow_slots(&packset);
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+	fatal_error("zlib initialization failed");
+#ifdef THREADS
+    if (threads > 1) {
+	int i;
+
+	submitted = claimed = written = inflight = 0;
+	draining = false;
+	nworkers = threads;
+	workers = xcalloc(nworkers, sizeof(pthread_t), "pack workers");
+	for (i = 0; i < nworkers; i++)
+	    if (pthread_create(&workers[i], NULL, pack_worker, NULL) != 0)
+		fatal_system_error("cannot start pack worker");
+	if (pthread_create(&writer, NULL, pack_writer, NULL) != 0)
+	    fatal_system_error("cannot start pack writer");
+    }
+#endif /* THREADS */
+}
+
+void
+pack_object(const enum pack_type type,
+	    const struct iovec *iov, const int iovcnt, const size_t len,
+	    unsigned char sha[SHA1_RAWSZ])
+{
+    name_object(type, iov, iovcnt, len, sha);
+#ifdef THREADS
+    if (workers != NULL) {
+	if (lookup_object(&named, sha) == NULL) {
+	    add_object(&named, sha);
+	    submit(type, iov, iovcnt, len, NULL, 0, NULL, sha, NULL);
+	}
+	return;
+    }
+#endif /* THREADS */
+    if (lookup_object(&packset, sha) != NULL)
+	return;
+    encode_entry(&zs, type, iov, iovcnt, len, &serial_entry);
+    write_entry(sha, &serial_entry, NULL);
+}
+
+static size_t
+base_slot(const unsigned char *source)
+{
+    uintptr_t h = (uintptr_t)source;
+
+    /* lines are at least a byte apart; mix the low bits upward */
+    h ^= h >> 17;
+    h *= 0x9E3779B1U;
+    return (h ^ (h >> 15)) & (base.nslots - 1);
+}
+
+static void
+set_base(const size_t len,
+	 const line_origin_t *origin, const size_t norigin,
+	 unsigned char *sha, const int depth)
+/* make the blob in scratch.text the next delta base */
+{
+    unsigned char *t = base.text;
+    size_t i, j, offset = 0;
+
+    /* trade buffers, so the old base text becomes scratch */
+    base.text = scratch.text;
+    scratch.text = t;
+    i = base.max;
+    base.max = scratch.max;
+    scratch.max = i;
+    base.len = len;
+
+    if (base.maxorigin < norigin) {
+	base.maxorigin = norigin;
+	base.origin = xrealloc(base.origin,
+			       sizeof(line_origin_t) * norigin, "pack delta");
+	base.start = xrealloc(base.start, sizeof(size_t) * norigin,
+			      "pack delta");
+    }
+    memcpy(base.origin, origin, sizeof(line_origin_t) * norigin);
+    base.norigin = norigin;
+    if (base.nslots < 2 * norigin) {
+	while (base.nslots < 2 * norigin)
+	    base.nslots = base.nslots ? base.nslots * 2 : 1024;
+	free(base.slots);
+	base.slots = xmalloc(sizeof(size_t) * base.nslots, "pack delta");
+    }
+    memset(base.slots, 0, sizeof(size_t) * base.nslots);
+    /* where a source repeats, the first occurrence is kept */
+    for (i = 0; i < norigin; i++) {
+	base.start[i] = offset;
+	offset += origin[i].length;
+	for (j = base_slot(origin[i].source); base.slots[j] != 0;
+	     j = (j + 1) & (base.nslots - 1))
+	    if (base.origin[base.slots[j] - 1].source == origin[i].source)
+		break;
+	if (base.slots[j] == 0)
+	    base.slots[j] = i + 1;
+    }
+    base.sha = sha;
+    base.depth = depth;
+    base.valid = true;
+}
+
+static long
+find_base_line(const unsigned char *source)
+{
+    size_t j;
+
+    for (j = base_slot(source); base.slots[j] != 0;
+	 j = (j + 1) & (base.nslots - 1))
+	if (base.origin[base.slots[j] - 1].source == source)
+	    return (long)base.slots[j] - 1;
+    return -1;
+}
+
+static size_t
+put_varint(unsigned char *p, size_t v)
+/* a size in a delta header: 7 bits at a time, low bits first */
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+	p[n++] = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static bool
+delta_room(const size_t n, const size_t need, const size_t limit)
+/* make space for NEED more bytes of delta, unless that is too many */
+{
+    if (n + need > limit)
+	return false;
+    if (n + need > scratch.deltamax) {
+	scratch.deltamax = scratch.deltamax ? scratch.deltamax * 2 : 4096;
+	if (scratch.deltamax < n + need)
+	    scratch.deltamax = n + need;
+	scratch.delta = xrealloc(scratch.delta, scratch.deltamax, "pack delta");
+    }
+    return true;
+}
+
+static bool
+delta_copy(size_t *n, size_t offset, size_t len, const size_t limit)
+/* copy instructions for LEN bytes of the base starting at OFFSET */
+{
+    while (len > 0) {
+	size_t size = len < DELTA_COPY_MAX ? len : DELTA_COPY_MAX;
+	unsigned char *op;
+	int i, k = 1;
+
+	if (!delta_room(*n, 8, limit))
+	    return false;
+	op = scratch.delta + *n;
+	op[0] = 0x80;
+	for (i = 0; i < 4; i++)
+	    if ((offset >> (8 * i)) & 0xff) {
+		op[0] |= 1 << i;
+		op[k++] = (offset >> (8 * i)) & 0xff;
+	    }
+	/* a size of 0x10000 is written as no size bytes at all */
+	for (i = 0; i < 3 && size != DELTA_COPY_MAX; i++)
+	    if ((size >> (8 * i)) & 0xff) {
+		op[0] |= 0x10 << i;
+		op[k++] = (size >> (8 * i)) & 0xff;
+	    }
+	*n += k;
+	offset += size;
+	len -= size;
+    }
+    return true;
+}
+
+static bool
+delta_insert(size_t *n, const unsigned char *p, size_t len,
+	     const size_t limit)
+/* insert instructions carrying LEN literal bytes */
+{
+    while (len > 0) {
+	size_t size = len < 0x7f ? len : 0x7f;
+
+	if (!delta_room(*n, size + 1, limit))
+	    return false;
+	scratch.delta[(*n)++] = (unsigned char)size;
+	memcpy(scratch.delta + *n, p, size);
+	*n += size;
+	p += size;
+	len -= size;
+    }
+    return true;
+}
+
+static size_t
+make_delta(const unsigned char *text, const size_t len,
+	   const line_origin_t *origin, const size_t norigin)
+/*
+ * Turn the lines TEXT shares with the base into copy instructions and
+ * the rest into inserts.  A shared line has the same origin, which is
+ * what the RCS edit that made one revision from the other left alone,
+ * and the same bytes, which keyword expansion may have changed.
+ * Returns the size of the delta, or 0 if it would not pay, which git
+ * pack-objects takes to be more than half the blob.
+ */
+{
+    size_t n = 0, limit = len / 2, i, at = 0, pending = 0, copyfrom = 0;
+    size_t literal = 0;
+    long j;
+
+    if (!delta_room(0, 20, limit))
+	return 0;
+    n += put_varint(scratch.delta + n, base.len);
+    n += put_varint(scratch.delta + n, len);
+    for (i = 0; i < norigin; i++) {
+	size_t length = origin[i].length;
+
+	j = find_base_line(origin[i].source);
+	if (j >= 0 && base.origin[j].length == length
+	    && memcmp(base.text + base.start[j], text + at, length) == 0) {
+	    if (pending > 0 && copyfrom + pending == base.start[j])
+		pending += length;
+	    else {
+		if (!delta_copy(&n, copyfrom, pending, limit)
+		    || !delta_insert(&n, text + literal, at - literal, limit))
+		    return 0;
+		copyfrom = base.start[j];
+		pending = length;
+	    }
+	    literal = at + length;
+	} else if (pending > 0) {
+	    if (!delta_copy(&n, copyfrom, pending, limit))
+		return 0;
+	    pending = 0;
+	}
+	at += length;
+    }
+    if (!delta_copy(&n, copyfrom, pending, limit)
+	|| !delta_insert(&n, text + literal, len - literal, limit))
+	return 0;
+    return n;
+}
+
+void
+pack_blob(const struct iovec *iov, const int iovcnt, const size_t len,
+	  const line_origin_t *origin, const size_t norigin,
+	  unsigned char sha[SHA1_RAWSZ])
+{
+    size_t deltalen = 0, total = 0, i;
+    struct iovec whole;
+    int depth = 0;
+    unsigned char *p;
+
+    for (i = 0; i < norigin; i++)
+	total += origin[i].length;
+    /* a base past 4GB cannot be addressed by copy instructions */
+    if (norigin == 0 || total != len || len > 0xffffffffU) {
+	base.valid = false;
+#ifdef THREADS
+	if (workers != NULL) {
+	    submit(PACK_BLOB, iov, iovcnt, len, NULL, 0, NULL, NULL, sha);
+	    return;
+	}
+#endif /* THREADS */
+	pack_object(PACK_BLOB, iov, iovcnt, len, sha);
+	return;
+    }
+
+    /* the blob is kept whole, as the base for the next one */
+    if (scratch.max < len) {
+	scratch.max = len;
+	scratch.text = xrealloc(scratch.text, len ? len : 1, "pack delta");
+    }
+    for (p = scratch.text, i = 0; i < (size_t)iovcnt; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+    if (base.valid && base.depth < DELTA_DEPTH) {
+	deltalen = make_delta(scratch.text, len, origin, norigin);
+	if (deltalen > 0)
+	    depth = base.depth + 1;
+    }
+    whole.iov_base = scratch.text;
+    whole.iov_len = len;
+
+#ifdef THREADS
+    if (workers != NULL)
+	submit(PACK_BLOB, &whole, 1, len, scratch.delta, deltalen,
+	       deltalen > 0 ? base.sha : NULL, NULL, sha);
+    else
+#endif /* THREADS */
+    {
+	name_object(PACK_BLOB, &whole, 1, len, sha);
+	if (lookup_object(&packset, sha) == NULL) {
+	    if (deltalen > 0) {
+		whole.iov_base = scratch.delta;
+		whole.iov_len = deltalen;
+		encode_entry(&zs, PACK_OFS_DELTA, &whole, 1, deltalen,
+			     &serial_entry);
+		write_entry(sha, &serial_entry, base.sha);
+	    } else {
+		encode_entry(&zs, PACK_BLOB, &whole, 1, len, &serial_entry);
+		write_entry(sha, &serial_entry, NULL);
+	    }
+	}
+	/* a duplicate keeps the depth it was stored at */
+	depth = lookup_object(&packset, sha)->depth;
+    }
+    set_base(len, origin, norigin, sha, depth);
+}
+
+void
+pack_blob_chain_end(void)
+{
+    base.valid = false;
+}
+
+void
+pack_wait(void)
+{
+#ifdef THREADS
+    if (workers != NULL) {
+	pthread_mutex_lock(&pipe_mutex);
+	while (written < submitted)
+	    pthread_cond_wait(&space_cond, &pipe_mutex);
+	pthread_mutex_unlock(&pipe_mutex);
+    }
+#endif /* THREADS */
+}
+
+static int
+compare_tree_entry(const void *a, const void *b)
+/* git's tree order, in which a directory sorts as its name and a slash */
+{
+    const struct pack_tree_entry *ea = a, *eb = b;
+    size_t n = ea->namelen < eb->namelen ? ea->namelen : eb->namelen;
+    int cmp = memcmp(ea->name, eb->name, n), ca, cb;
+
+    if (cmp != 0)
+	return cmp;
+    ca = n < ea->namelen ? (unsigned char)ea->name[n]
+	: ea->mode == 040000 ? '/' : '\0';
+    cb = n < eb->namelen ? (unsigned char)eb->name[n]
+	: eb->mode == 040000 ? '/' : '\0';
+    return ca - cb;
+}
+
+void
+pack_tree(struct pack_tree_entry *ent, const size_t n,
+	  unsigned char sha[SHA1_RAWSZ])
+{
+    static char *buf;
+    static size_t size;
+    size_t used = 0, i;
+    struct iovec iov;
+
+    qsort(ent, n, sizeof(struct pack_tree_entry), compare_tree_entry);
+    for (i = 0; i < n; i++) {
+	if (used + ent[i].namelen + SHA1_RAWSZ + 8 > size) {
+	    size = 2 * size + ent[i].namelen + SHA1_RAWSZ + 8;
+	    buf = xrealloc(buf, size, "tree object");
+	}
+	used += sprintf(buf + used, "%o ", ent[i].mode);
+	memcpy(buf + used, ent[i].name, ent[i].namelen);
+	used += ent[i].namelen;
+	buf[used++] = '\0';
+	memcpy(buf + used, ent[i].sha, SHA1_RAWSZ);
+	used += SHA1_RAWSZ;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = used;
+    pack_object(PACK_TREE, &iov, 1, used, sha);
+}
+
+void
+pack_ref(const char *prefix, const char *name,
+	 const unsigned char sha[SHA1_RAWSZ])
+{
+    size_t plen = strlen(prefix), nlen = strlen(name);
+
+    if (nrefs == maxrefs) {
+	maxrefs = maxrefs ? maxrefs * 2 : 256;
+	refs = xrealloc(refs, sizeof(struct packref) * maxrefs, "pack refs");
+    }
+    refs[nrefs].name = xmalloc(plen + nlen + 1, "pack refs");
+    memcpy(refs[nrefs].name, prefix, plen);
+    memcpy(refs[nrefs].name + plen, name, nlen + 1);
+    memcpy(refs[nrefs].sha, sha, SHA1_RAWSZ);
+    refs[nrefs].order = nrefs;
+    nrefs++;
+}
+
+static int
+compare_packed(const void *a, const void *b)
+{
+    return memcmp(((const struct packed *)a)->sha,
+		  ((const struct packed *)b)->sha, SHA1_RAWSZ);
+}
+
+static int
+compare_ref(const void *a, const void *b)
+{
+    const struct packref *ra = a, *rb = b;
+    int cmp = strcmp(ra->name, rb->name);
+
+    if (cmp != 0)
+	return cmp;
+    return ra->order < rb->order ? -1 : 1;
+}
+
+static void
+hashed_write(FILE *fp, sha1_ctx *ctx, const void *buf, const size_t len,
+	     const char *path)
+{
+    if (fwrite(buf, 1, len, fp) != len)
+	fatal_system_error("write to %s failed", path);
+    if (ctx != NULL)
+	sha1_update(ctx, buf, len);
+}
+
+static void
+put_be32(unsigned char *p, const uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void
+finish_pack(unsigned char packsha[SHA1_RAWSZ])
+/* patch the object count into the header and append the checksum */
+{
+    unsigned char buf[64 * 1024];
+    sha1_ctx ctx;
+    size_t n;
+
+    put_be32(buf, (uint32_t)packset.count);
+    if (fflush(packfp) != 0 || fseeko(packfp, 8, SEEK_SET) != 0
+	|| fwrite(buf, 1, 4, packfp) != 4 || fflush(packfp) != 0
+	|| fseeko(packfp, 0, SEEK_SET) != 0)
+	fatal_system_error("cannot rewrite header of %s", tmppack);
+    sha1_init(&ctx);
+    while ((n = fread(buf, 1, sizeof(buf), packfp)) > 0)
+	sha1_update(&ctx, buf, n);
+    if (ferror(packfp))
+	fatal_system_error("cannot reread %s", tmppack);
+    sha1_final(&ctx, packsha);
+    if (fseeko(packfp, 0, SEEK_END) != 0)
+	fatal_system_error("cannot append to %s", tmppack);
+    hashed_write(packfp, NULL, packsha, SHA1_RAWSZ, tmppack);
+    if (fclose(packfp) != 0)
+	fatal_system_error("cannot close %s", tmppack);
+    packfp = NULL;
+}
+
+static void
+write_index(const char *path, const unsigned char packsha[SHA1_RAWSZ])
+/* version 2 pack index: fan-out, names, CRCs, offsets, checksums */
+{
+    static const unsigned char header[8] = {0xff, 't', 'O', 'c', 0, 0, 0, 2};
+    unsigned char buf[8], idxsha[SHA1_RAWSZ];
+    uint32_t fanout[256] = {0}, nlarge = 0;
+    struct packed *objects = packset.objects;
+    size_t nobjects = packset.count, i;
+    sha1_ctx ctx;
+    FILE *fp;
+
+    qsort(objects, nobjects, sizeof(struct packed), compare_packed);
+    for (i = 0; i < nobjects; i++)
+	fanout[objects[i].sha[0]]++;
+    for (i = 1; i < 256; i++)
+	fanout[i] += fanout[i - 1];
+
+    if ((fp = fopen(path, "w")) == NULL)
+	fatal_system_error("cannot create %s", path);
+    sha1_init(&ctx);
+    hashed_write(fp, &ctx, header, sizeof(header), path);
+    for (i = 0; i < 256; i++) {
+	put_be32(buf, fanout[i]);
+	hashed_write(fp, &ctx, buf, 4, path);
+    }
+    for (i = 0; i < nobjects; i++)
+	hashed_write(fp, &ctx, objects[i].sha, SHA1_RAWSZ, path);
+    for (i = 0; i < nobjects; i++) {
+	put_be32(buf, objects[i].crc);
+	hashed_write(fp, &ctx, buf, 4, path);
+    }
+    /* offsets past 2GB go to a second table of 8-byte entries */
+    for (i = 0; i < nobjects; i++) {
+	if (objects[i].offset < 0x80000000U)
+	    put_be32(buf, (uint32_t)objects[i].offset);
+	else
+	    put_be32(buf, 0x80000000U | nlarge++);
+	hashed_write(fp, &ctx, buf, 4, path);
+    }
+    for (i = 0; i < nobjects; i++) {
+	if (objects[i].offset >= 0x80000000U) {
+	    put_be32(buf, (uint32_t)(objects[i].offset >> 32));
+	    put_be32(buf + 4, (uint32_t)objects[i].offset);
+	    hashed_write(fp, &ctx, buf, 8, path);
+	}
+    }
+    hashed_write(fp, &ctx, packsha, SHA1_RAWSZ, path);
+    sha1_final(&ctx, idxsha);
+    hashed_write(fp, NULL, idxsha, SHA1_RAWSZ, path);
+    if (fclose(fp) != 0)
+	fatal_system_error("cannot close %s", path);
+}
+
+static void
+write_refs(void)
+/* replace packed-refs with the refs of this export */
+{
+    char path[PATH_MAX], tmp[PATH_MAX], hex[SHA1_HEXSZ + 1];
+    FILE *fp;
+    size_t i;
+
+    qsort(refs, nrefs, sizeof(struct packref), compare_ref);
+    git_path(path, "%s/packed-refs", gitdir);
+    git_path(tmp, "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+	fatal_system_error("cannot create %s", tmp);
+    fputs("# pack-refs with: peeled fully-peeled sorted \n", fp);
+    for (i = 0; i < nrefs; i++) {
+	if (i + 1 < nrefs && strcmp(refs[i].name, refs[i + 1].name) == 0)
+	    continue;
+	fprintf(fp, "%s %s\n", sha1_to_hex(refs[i].sha, hex), refs[i].name);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+	fatal_system_error("cannot write %s", path);
+}
+
+static void
+stop_workers(void)
+/* let the workers and the writer finish what they hold and exit */
+{
+#ifdef THREADS
+    size_t i;
+
+    if (workers == NULL)
+	return;
+    pthread_mutex_lock(&pipe_mutex);
+    draining = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&pipe_mutex);
+    for (i = 0; i < (size_t)nworkers; i++)
+	pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+    free(workers);
+    workers = NULL;
+    for (i = 0; i < PIPE_DEPTH; i++) {
+	free(ring[i].data);
+	free(ring[i].entry.out);
+    }
+    memset(ring, 0, sizeof(ring));
+    free_objset(&named);
+#endif /* THREADS */
+    deflateEnd(&zs);
+}
+
+static void
+release(void)
+/* drop everything pack_begin() and the objects since have allocated */
+{
+    size_t i;
+
+    for (i = 0; i < nrefs; i++)
+	free(refs[i].name);
+    free(refs);
+    refs = NULL;
+    nrefs = maxrefs = 0;
+    free_objset(&packset);
+    free(serial_entry.out);
+    memset(&serial_entry, 0, sizeof(serial_entry));
+    free(base.text);
+    free(base.origin);
+    free(base.start);
+    free(base.slots);
+    memset(&base, 0, sizeof(base));
+    free(scratch.text);
+    free(scratch.delta);
+    memset(&scratch, 0, sizeof(scratch));
+}
+
+void
+pack_end(void)
+{
+    unsigned char packsha[SHA1_RAWSZ];
+    char hex[SHA1_HEXSZ + 1], path[PATH_MAX], idx[PATH_MAX], tmpidx[PATH_MAX];
+
+    stop_workers();
+    finish_pack(packsha);
+    sha1_to_hex(packsha, hex);
+
+    /* the index goes last; until it exists git ignores the pack */
+    git_path(path, "%s/objects/pack/pack-%s.pack", gitdir, hex);
+    git_path(idx, "%s/objects/pack/pack-%s.idx", gitdir, hex);
+    git_path(tmpidx, "%s/objects/pack/tmp_idx_%s", gitdir, hex);
+    if (rename(tmppack, path) != 0)
+	fatal_system_error("cannot rename %s to %s", tmppack, path);
+    write_index(tmpidx, packsha);
+    if (rename(tmpidx, idx) != 0)
+	fatal_system_error("cannot rename %s to %s", tmpidx, idx);
+    write_refs();
+    release();
+}
+
+void
+pack_abort(void)
+{
+    stop_workers();
+    (void)fclose(packfp);
+    packfp = NULL;
+    (void)unlink(tmppack);
+    release();
+}
+#endif /* GITPACK */
+
+/* end */
@@ -0,0 +1,69 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <sys/uio.h>
+#include "sha1.h"
+
+/* object types as numbered in pack entry headers */
+enum pack_type {
+    PACK_COMMIT = 1,
+    PACK_TREE = 2,
+    PACK_BLOB = 3,
+    PACK_TAG = 4,
+    PACK_OFS_DELTA = 6,
+};
+
+/* start a pack in the objects directory of a git repository with no refs */
+void
+pack_begin(const char *dir);
+
+/* name an object and add it to the pack unless it is already there */
+void
+pack_object(const enum pack_type type,
+	    const struct iovec *iov, const int iovcnt, const size_t len,
+	    unsigned char sha[SHA1_RAWSZ]);
+
+/*
+ * Add a blob whose name may be filled in as late as pack_wait().  With
+ * line origins it may be stored as a delta against the previous blob.
+ */
+void
+pack_blob(const struct iovec *iov, const int iovcnt, const size_t len,
+	  const line_origin_t *origin, const size_t norigin,
+	  unsigned char sha[SHA1_RAWSZ]);
+
+/* the next blob is not related to the previous one */
+void
+pack_blob_chain_end(void);
+
+/* wait until every object handed over so far is named and in the pack */
+void
+pack_wait(void);
+
+/* one entry of a tree object */
+struct pack_tree_entry {
+    const char		*name;
+    size_t		namelen;
+    unsigned int	mode;		/* 0100644, 0100755 or 040000 */
+    const unsigned char	*sha;
+};
+
+/* write a tree of N entries in any order; they are sorted in place */
+void
+pack_tree(struct pack_tree_entry *ent, const size_t n,
+	  unsigned char sha[SHA1_RAWSZ]);
+
+/* point PREFIX NAME at an object once the pack is finished */
+void
+pack_ref(const char *prefix, const char *name,
+	 const unsigned char sha[SHA1_RAWSZ]);
+
+/* finish the pack, write its index and the refs */
+void
+pack_end(void);
+
+/* give up on the pack, removing it and writing no refs */
+void
+pack_abort(void);
+
+#endif /* _PACK_H_ */
@@ -52,6 +52,19 @@ revdir_iter_next_dir(revdir_iter *it);
 bool
 revdir_iter_same_dir(const revdir_iter *it1, const revdir_iter *it2);
 
+#ifdef GITPACK
+#include "sha1.h"
+
+/*
+ * Name the git tree of a revdir, putting each directory in the pack the
+ * first time it is seen.  BLOB gives the name of the blob for a file.
+ */
+void
+revdir_tree(const revdir *revdir,
+	    const unsigned char *(*blob)(const cvs_commit *),
+	    unsigned char sha[SHA1_RAWSZ]);
+#endif /* GITPACK */
+
 void
 revdir_free_bufs(void);
 
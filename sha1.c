@@ -0,0 +1,142 @@
+/*
+ * SHA-1 as specified in FIPS 180-4, for naming git objects.
+ *
+ * Git object names are defined by this hash, so writing objects
+ * directly needs it; a straightforward implementation keeps the
+ * program free of a crypto library dependency.
+ *
+ *  SPDX-License-Identifier: GPL-2.0+
+ */
+#include <string.h>
+#include "sha1.h"
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(uint32_t state[5], const unsigned char *p)
+/* mix one 64-byte block into the state */
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16
+	    | (uint32_t)p[4*i+2] << 8 | (uint32_t)p[4*i+3];
+    for (; i < 80; i++)
+	w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5A827999;
+	} else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ED9EBA1;
+	} else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8F1BBCDC;
+	} else {
+	    f = b ^ c ^ d;
+	    k = 0xCA62C1D6;
+	}
+	t = ROL(a, 5) + f + e + k + w[i];
+	e = d;
+	d = c;
+	c = ROL(b, 30);
+	b = a;
+	a = t;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+void
+sha1_init(sha1_ctx *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->count = 0;
+}
+
+void
+sha1_update(sha1_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t fill = ctx->count % 64;
+
+    ctx->count += len;
+    if (fill > 0) {
+	size_t n = 64 - fill < len ? 64 - fill : len;
+	memcpy(ctx->buffer + fill, p, n);
+	p += n;
+	len -= n;
+	if (fill + n < 64)
+	    return;
+	sha1_block(ctx->state, ctx->buffer);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	sha1_block(ctx->state, p);
+    memcpy(ctx->buffer, p, len);
+}
+
+void
+sha1_final(sha1_ctx *ctx, unsigned char digest[SHA1_RAWSZ])
+{
+    static const unsigned char pad[64] = {0x80};
+    unsigned char bits[8];
+    uint64_t nbits = ctx->count * 8;
+    size_t fill = ctx->count % 64;
+    int i;
+
+    for (i = 0; i < 8; i++)
+	bits[i] = (unsigned char)(nbits >> (56 - 8 * i));
+    sha1_update(ctx, pad, fill < 56 ? 56 - fill : 120 - fill);
+    sha1_update(ctx, bits, 8);
+    for (i = 0; i < 20; i++)
+	digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+void
+sha1_save(const sha1_ctx *ctx, unsigned char buf[SHA1_SAVESZ])
+{
+    int i;
+
+    for (i = 0; i < 20; i++)
+	buf[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    for (i = 0; i < 8; i++)
+	buf[20 + i] = (unsigned char)(ctx->count >> (56 - 8 * i));
+    memcpy(buf + 28, ctx->buffer, 64);
+}
+
+void
+sha1_restore(sha1_ctx *ctx, const unsigned char buf[SHA1_SAVESZ])
+{
+    int i;
+
+    memset(ctx->state, 0, sizeof(ctx->state));
+    for (i = 0; i < 20; i++)
+	ctx->state[i / 4] |= (uint32_t)buf[i] << (24 - 8 * (i % 4));
+    ctx->count = 0;
+    for (i = 0; i < 8; i++)
+	ctx->count = ctx->count << 8 | buf[20 + i];
+    memcpy(ctx->buffer, buf + 28, 64);
+}
+
+char *
+sha1_to_hex(const unsigned char sha[SHA1_RAWSZ], char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA1_RAWSZ; i++) {
+	buf[2*i] = hex[sha[i] >> 4];
+	buf[2*i+1] = hex[sha[i] & 0xf];
+    }
+    buf[SHA1_HEXSZ] = '\0';
+    return buf;
+}
+
+/* end */
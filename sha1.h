@@ -0,0 +1,37 @@
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_RAWSZ	20
+#define SHA1_HEXSZ	40
+
+typedef struct _sha1_ctx {
+    uint32_t		state[5];
+    uint64_t		count;		/* bytes hashed so far */
+    unsigned char	buffer[64];
+} sha1_ctx;
+
+void
+sha1_init(sha1_ctx *ctx);
+
+void
+sha1_update(sha1_ctx *ctx, const void *data, size_t len);
+
+void
+sha1_final(sha1_ctx *ctx, unsigned char digest[SHA1_RAWSZ]);
+
+/* a hash in progress as bytes in a fixed order, and back */
+#define SHA1_SAVESZ	(5 * 4 + 8 + 64)
+void
+sha1_save(const sha1_ctx *ctx, unsigned char buf[SHA1_SAVESZ]);
+
+void
+sha1_restore(sha1_ctx *ctx, const unsigned char buf[SHA1_SAVESZ]);
+
+/* format a raw digest as 40 hex digits plus NUL */
+char *
+sha1_to_hex(const unsigned char sha[SHA1_RAWSZ], char *buf);
+
+#endif /* _SHA1_H_ */
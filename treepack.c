@@ -18,6 +18,14 @@ struct _rev_pack {
     serial_t   nfiles;
     rev_pack   **dirs;
     cvs_commit **files;
+#ifdef GITPACK
+    /*
+     * A rev_pack stands for one directory with fixed contents, so its
+     * git tree is written once and the name kept here.
+     */
+    const master_dir *dir;
+    unsigned char *tree;
+#endif /* GITPACK */
 };
 
 typedef struct _rev_pack_hash {
@@ -68,6 +76,10 @@ rev_pack_dir(void)
     h->dir.nfiles = nfiles;
     h->dir.files = xmalloc(nfiles * sizeof(cvs_commit *), __func__);
     memcpy(h->dir.files, files, nfiles * sizeof(cvs_commit *));
+#ifdef GITPACK
+    h->dir.dir = frame->dir;
+    h->dir.tree = NULL;
+#endif /* GITPACK */
     return &h->dir;
 }
 
@@ -345,6 +357,61 @@ revdir_pack_files(const cvs_commit **files, const size_t nfiles, revdir *revdir)
     revdir_pack_free();
 }
 
+#ifdef GITPACK
+static const unsigned char *
+rev_pack_tree(const rev_pack *dir,
+	      const unsigned char *(*blob)(const cvs_commit *))
+/* the name of a directory's tree, written out the first time it is asked */
+{
+    static struct pack_tree_entry *ent;
+    static size_t maxent;
+    /* the cached name is not part of the rev_pack's identity */
+    rev_pack *pack = (rev_pack *)dir;
+    size_t n = 0, prefix;
+    serial_t i;
+
+    if (pack->tree != NULL)
+	return pack->tree;
+    /* subtrees first, as their entries here need their names */
+    for (i = 0; i < pack->ndirs; i++)
+	rev_pack_tree(pack->dirs[i], blob);
+
+    if (maxent < (size_t)pack->ndirs + pack->nfiles) {
+	maxent = pack->ndirs + pack->nfiles;
+	ent = xrealloc(ent, sizeof(struct pack_tree_entry) * maxent, __func__);
+    }
+    prefix = strlen(pack->dir->name);
+    if (prefix > 0)
+	prefix++;
+    for (i = 0; i < pack->ndirs; i++, n++) {
+	ent[n].name = pack->dirs[i]->dir->name + prefix;
+	ent[n].namelen = strlen(ent[n].name);
+	ent[n].mode = 040000;
+	ent[n].sha = pack->dirs[i]->tree;
+    }
+    for (i = 0; i < pack->nfiles; i++, n++) {
+	const rev_master *master = pack->files[i]->master;
+	const char *slash = strrchr(master->fileop_name, '/');
+
+	ent[n].name = slash ? slash + 1 : master->fileop_name;
+	ent[n].namelen = strlen(ent[n].name);
+	ent[n].mode = (master->mode & 0100) ? 0100755 : 0100644;
+	ent[n].sha = blob(pack->files[i]);
+    }
+    pack->tree = xmalloc(SHA1_RAWSZ, __func__);
+    pack_tree(ent, n, pack->tree);
+    return pack->tree;
+}
+
+void
+revdir_tree(const revdir *revdir,
+	    const unsigned char *(*blob)(const cvs_commit *),
+	    unsigned char sha[SHA1_RAWSZ])
+{
+    memcpy(sha, rev_pack_tree(revdir->revpack, blob), SHA1_RAWSZ);
+}
+#endif /* GITPACK */
+
 void
 revdir_free(void)
 {
@@ -357,6 +424,9 @@ revdir_free(void)
 	    *bucket = h->next;
 	    free(h->dir.dirs);
 	    free(h->dir.files);
+#ifdef GITPACK
+	    free(h->dir.tree);
+#endif /* GITPACK */
 	    free(h);
 	}
     }
@@ -82,6 +82,50 @@ cvstime2rfc3339(const cvstime_t date)
     return timestr;
 }
 
+void
+cvstime2rcsdate(const cvstime_t date, char *buf)
+/* RCS keyword date YYYY/MM/DD HH:MM:SS, UTC, into buf[RCS_DATE_LEN] */
+{
+    /*
+     * Pure arithmetic, so unlike localtime() this is reentrant and
+     * never consults the timezone.  The conversion from days to a
+     * civil date is Howard Hinnant's days_from_civil() in reverse.
+     */
+    uint64_t t = (uint64_t)RCS_EPOCH + date;
+    uint32_t secs = t % 86400, days = t / 86400;
+    uint32_t z = days + 719468;
+    uint32_t era = z / 146097;
+    uint32_t doe = z - era * 146097;
+    uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+    uint32_t mp = (5*doy + 2) / 153;
+    uint32_t d = doy - (153*mp + 2)/5 + 1;
+    uint32_t m = mp < 10 ? mp + 3 : mp - 9;
+    uint32_t y = yoe + era * 400 + (m <= 2);
+    uint32_t hh = secs / 3600, mm = secs / 60 % 60, ss = secs % 60;
+
+    buf[0] = '0' + y / 1000;
+    buf[1] = '0' + y / 100 % 10;
+    buf[2] = '0' + y / 10 % 10;
+    buf[3] = '0' + y % 10;
+    buf[4] = '/';
+    buf[5] = '0' + m / 10;
+    buf[6] = '0' + m % 10;
+    buf[7] = '/';
+    buf[8] = '0' + d / 10;
+    buf[9] = '0' + d % 10;
+    buf[10] = ' ';
+    buf[11] = '0' + hh / 10;
+    buf[12] = '0' + hh % 10;
+    buf[13] = ':';
+    buf[14] = '0' + mm / 10;
+    buf[15] = '0' + mm % 10;
+    buf[16] = ':';
+    buf[17] = '0' + ss / 10;
+    buf[18] = '0' + ss % 10;
+    buf[19] = '\0';
+}
+
 /*
  * Print progress messages.
  *